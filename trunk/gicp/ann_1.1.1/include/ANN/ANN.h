@@ -624,7 +624,7 @@ const int ANN_N_SHRINK_RULES	= 4;	// number of shrink rules
 //
 //		Search:
 //		-------
-//		There are two search methods:
+//		There are three search methods:
 //
 //			Standard search (annkSearch()):
 //				Searches nodes in tree-traversal order, always visiting
@@ -635,6 +635,15 @@ const int ANN_N_SHRINK_RULES	= 4;	// number of shrink rules
 //				distributions the standard search seems to work just
 //				fine, but priority search is safer for worst-case
 //				performance.
+//			Batched search (annkSearchBatch()):
+//				Standard search for an array of query points.  The
+//				queries are visited in Morton (Z-order) order of their
+//				quantized coordinates so that consecutive searches walk
+//				the same part of the tree, and each search starts with
+//				a distance bound taken from the previous query's
+//				neighbors.  The queries may be split across several
+//				threads.  Results are returned in the caller's order:
+//				the neighbors of query i are nn_idx[i*k .. i*k+k-1].
 //
 //		Printing:
 //		---------
@@ -717,6 +726,19 @@ protected:
 		ANNpointArray pa = NULL,		// point array (optional)
 		ANNidxArray pi = NULL);			// point indices (optional)
 
+	void annkSearchOrdered(				// search a run of batched queries
+		ANNpointArray	qa,				// query points
+		const int		*order,			// query indices in search order
+		int				begin,			// first position in order
+		int				end,			// one past last position in order
+		int				k,				// number of near neighbors to return
+		ANNidxArray		nn_idx,			// nearest neighbors, m*k (modified)
+		ANNdistArray	dd,				// dist to near neighbors, m*k (modified)
+		double			eps);			// error bound
+
+	friend void* annkBatchThread(void*);	// batch search worker
+	friend class ANNkd_flat_tree;		// flattens the tree
+
 public:
 	ANNkd_tree(							// build skeleton tree
 		int				n = 0,			// number of points
@@ -757,6 +779,15 @@ public:
 		ANNdistArray	dd = NULL,		// dist to near neighbors (modified)
 		double			eps=0.0);		// error bound
 
+	void annkSearchBatch(				// approx kNN search for many queries
+		ANNpointArray	qa,				// query points
+		int				m,				// number of query points
+		int				k,				// number of near neighbors to return
+		ANNidxArray		nn_idx,			// nearest neighbors, m*k (modified)
+		ANNdistArray	dd,				// dist to near neighbors, m*k (modified)
+		double			eps=0.0,		// error bound
+		int				n_threads=1);	// number of search threads
+
 	int theDim()						// return dimension of space
 		{ return dim; }
 
@@ -811,6 +842,112 @@ public:
 		std::istream&	in);			// input stream for dump file
 };
 
+//----------------------------------------------------------------------
+//	Flattened kd-tree
+//		The nodes of a kd-tree are allocated individually and linked
+//		by pointers, so a search jumps around the heap, and the points
+//		of a bucket are found through the point array.  A flattened
+//		kd-tree stores the same tree in three contiguous arrays: the
+//		nodes in breadth-first order (the children of a node are
+//		adjacent), and the coordinates and indices of the points of
+//		the buckets, leaf after leaf.  A leaf's points are thus read
+//		sequentially.  The search results are the same as those of the
+//		kd-tree it was built from.
+//
+//		It is built either from a point array (a kd-tree is built with
+//		the given bucket size and splitting rule, and then flattened)
+//		or from an existing kd-tree.  Trees with shrinking nodes
+//		(bd-trees) can not be flattened.  The bucket coordinates are a
+//		copy, but thePoints() still returns the original point array,
+//		which should be kept constant like for the kd-tree.
+//
+//		Standard and fixed-radius search are supported.
+//
+//		A flattened tree can be saved as a binary image (Save()): a
+//		versioned header followed by the arrays, without pointers, so
+//		the image can be loaded anywhere in memory.  The image
+//		constructor searches the image in place, e.g. in a memory
+//		mapped file, without copying or parsing anything.  The image
+//		must stay unchanged (and mapped) as long as the tree is used,
+//		and must be aligned to 8 bytes, as mmap() and new[] return it.
+//		Images are only portable between machines with the same byte
+//		order and the same ANNcoord and ANNidx types (this is checked).
+//		thePoints() returns NULL for such a tree, the point indices
+//		refer to the point array the image was made from.
+//----------------------------------------------------------------------
+
+struct ANNflat_node;			// node of a flattened kd-tree
+
+class DLL_API ANNkd_flat_tree: public ANNpointSet {
+protected:
+	int				dim;				// dimension of space
+	int				n_pts;				// number of points in tree
+	ANNpointArray	pts;				// the points
+	int				n_nodes;			// number of nodes
+	ANNflat_node	*nodes;				// nodes in breadth-first order
+	ANNcoord		*bkt_pts;			// bucket coordinates (dim*n_pts)
+	ANNidxArray		bkt_idx;			// bucket point indices (n_pts)
+	ANNpoint		bnd_box_lo;			// bounding box low point
+	ANNpoint		bnd_box_hi;			// bounding box high point
+	ANNbool			in_image;			// arrays are part of an image?
+
+	void Flatten(						// flatten a kd-tree
+		ANNkd_tree		&tree);			// the tree
+
+public:
+	ANNkd_flat_tree(					// build from point array
+		ANNpointArray	pa,				// point array
+		int				n,				// number of points
+		int				dd,				// dimension
+		int				bs = 1,			// bucket size
+		ANNsplitRule	split = ANN_KD_SUGGEST);	// splitting method
+
+	ANNkd_flat_tree(					// flatten an existing kd-tree
+		ANNkd_tree		&tree);			// the tree
+
+	ANNkd_flat_tree(					// search a binary image in place
+		const void		*image,			// the image (see Save())
+		size_t			size);			// size of the image in bytes
+
+	~ANNkd_flat_tree();					// tree destructor
+
+	void annkSearch(					// approx k near neighbor search
+		ANNpoint		q,				// query point
+		int				k,				// number of near neighbors to return
+		ANNidxArray		nn_idx,			// nearest neighbor array (modified)
+		ANNdistArray	dd,				// dist to near neighbors (modified)
+		double			eps=0.0);		// error bound
+
+	int annkFRSearch(					// approx fixed-radius kNN search
+		ANNpoint		q,				// the query point
+		ANNdist			sqRad,			// squared radius of query ball
+		int				k,				// number of neighbors to return
+		ANNidxArray		nn_idx = NULL,	// nearest neighbor array (modified)
+		ANNdistArray	dd = NULL,		// dist to near neighbors (modified)
+		double			eps=0.0);		// error bound
+
+	int theDim()						// return dimension of space
+		{ return dim; }
+
+	int nPoints()						// return number of points
+		{ return n_pts; }
+
+	ANNpointArray thePoints()			// return pointer to points
+		{  return pts;  }
+
+	int nNodes()						// return number of nodes
+		{ return n_nodes; }
+
+	size_t imageSize();					// size of the binary image
+
+	void Save(							// write the binary image
+		std::ostream&	out);			// output stream (binary mode)
+
+	static ANNbool isImage(				// is this a valid binary image?
+		const void		*image,			// the image
+		size_t			size);			// size of the image in bytes
+};
+
 //----------------------------------------------------------------------
 //	Other functions
 //	annMaxPtsVisit		Sets a limit on the maximum number of points
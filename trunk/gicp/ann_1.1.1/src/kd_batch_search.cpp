@@ -0,0 +1,260 @@
+//----------------------------------------------------------------------
+// File:			kd_batch_search.cpp
+// Programmer:		Sunil Arya and David Mount
+// Description:		Batched standard kd-tree search
+// Last modified:	01/04/05 (Version 1.0)
+//----------------------------------------------------------------------
+// Copyright (c) 1997-2005 University of Maryland and Sunil Arya and
+// David Mount.  All Rights Reserved.
+//
+// This software and related documentation is part of the Approximate
+// Nearest Neighbor Library (ANN).  This software is provided under
+// the provisions of the Lesser GNU Public License (LGPL).  See the
+// file ../ReadMe.txt for further information.
+//
+// The University of Maryland (U.M.) and the authors make no
+// representations about the suitability or fitness of this software for
+// any purpose.  It is provided "as is" without express or implied
+// warranty.
+//----------------------------------------------------------------------
+// History:
+//	Batched search added for GICP, which searches all points of a
+//	scan against the same tree in every iteration.
+//----------------------------------------------------------------------
+
+#include "kd_search.h"					// kd-search declarations
+
+#include <algorithm>					// sort
+#include <vector>						// vector
+
+#ifndef _WIN32
+#include <pthread.h>					// search threads
+#endif
+
+using namespace std;					// make std:: available
+
+//----------------------------------------------------------------------
+//	Batched approximate nearest neighbor searching
+//		annkSearchBatch() runs the standard search (see kd_search.cpp)
+//		for an array of m query points.  The result for query i is
+//		stored in nn_idx[i*k .. i*k+k-1] and dd[i*k .. i*k+k-1], so
+//		the caller gets the results in its own order.
+//
+//		Internally the queries are visited in Morton (Z-order) order.
+//		The Morton code interleaves the bits of the first (up to) three
+//		coordinates, quantized on the bounding box of the tree, so
+//		queries that are close in the order are mostly close in space.
+//		Consecutive searches then descend into the same nodes (which
+//		are still in the cache), and the neighbors of the previous
+//		query give a good starting hint for the next one: the largest
+//		distance from the new query to the previous query's k
+//		neighbors is an upper bound on the new query's k-th distance.
+//		The search starts with this bound (see ANNkdSearchCtx::bound),
+//		which prunes the far children from the start instead of only
+//		after the first leaf has been searched.  The result is the same
+//		as that of annkSearch().
+//
+//		If n_threads > 1 the sorted queries are split into contiguous
+//		runs, each of which is searched by its own thread.  This is
+//		safe since the search state is local to each search.
+//----------------------------------------------------------------------
+
+typedef unsigned long long ANNmorton;	// Morton code of a query point
+
+//----------------------------------------------------------------------
+//	annMortonCode - Morton code of a point within a bounding box
+//		Each of the nd coordinates is quantized to bits bits.
+//		Points outside the box are clamped to it.
+//----------------------------------------------------------------------
+
+static ANNmorton annMortonCode(
+	ANNpoint			q,				// the point
+	ANNpoint			lo,				// bounding box low point
+	ANNpoint			hi,				// bounding box high point
+	int					nd,				// number of coordinates used
+	int					bits)			// bits per coordinate
+{
+	ANNmorton cell[3];					// quantized coordinates
+	double max_cell = (double) ((1ULL << bits) - 1);
+
+	for (int d = 0; d < nd; d++) {
+		double len = hi[d] - lo[d];
+		double x = (len > 0) ? (q[d] - lo[d]) / len : 0;
+		if (x < 0) x = 0;
+		if (x > 1) x = 1;
+		cell[d] = (ANNmorton) (x * max_cell);
+	}
+
+	ANNmorton code = 0;					// interleave the bits
+	for (int b = bits-1; b >= 0; b--) {
+		for (int d = 0; d < nd; d++) {
+			code = (code << 1) | ((cell[d] >> b) & 1);
+		}
+	}
+	return code;
+}
+
+//----------------------------------------------------------------------
+//	annkSearchOrdered - search a run of the sorted queries
+//		Searches the queries order[begin .. end-1], seeding each search
+//		with the bound from the neighbors of the query before it.
+//----------------------------------------------------------------------
+
+void ANNkd_tree::annkSearchOrdered(
+	ANNpointArray		qa,				// the query points
+	const int			*order,			// query indices in search order
+	int					begin,			// first position in order
+	int					end,			// one past last position in order
+	int					k,				// number of near neighbors to return
+	ANNidxArray			nn_idx,			// nearest neighbor indices (returned)
+	ANNdistArray		dd,				// the approximate nearest neighbors
+	double				eps)			// the error bound
+{
+	ANNkdSearchCtx ctx;					// state of the current search
+	ctx.dim = dim;
+	ctx.pts = pts;
+	ctx.maxErr = ANN_POW(1.0 + eps);
+	ANN_FLOP(2)							// increment floating op count
+
+	for (int pos = begin; pos < end; pos++) {
+		int i = order[pos];				// index of the query
+		ctx.q = qa[i];
+		ctx.ptsVisited = 0;
+		ctx.bound = ANN_DIST_INF;
+
+		if (pos > begin) {				// bound from previous neighbors
+			ANNidxArray prev = nn_idx + order[pos-1]*k;
+			ANNdist worst = 0;
+			for (int l = 0; l < k && worst < ANN_DIST_INF; l++) {
+				if (prev[l] == ANN_NULL_IDX) {
+					worst = ANN_DIST_INF;
+					break;
+				}
+				ANNpoint pp = pts[prev[l]];
+				ANNdist dist = 0;		// computed as in the leaves
+				for (int d = 0; d < dim; d++) {
+					ANNcoord t = ctx.q[d] - pp[d];
+					dist = ANN_SUM(dist, ANN_POW(t));
+				}
+				if (dist == 0) {		// bound of 0 would reject all points
+					worst = ANN_DIST_INF;
+					break;
+				}
+				if (dist > worst) worst = dist;
+			}
+			if (worst < ANN_DIST_INF) {	// slightly loosened against ties
+				ctx.bound = worst * (1.0 + 1e-5);
+			}
+		}
+
+		ctx.pointMK = new ANNmin_k(k);	// create set for closest k points
+		root->ann_search(annBoxDistance(ctx.q, bnd_box_lo, bnd_box_hi, dim), ctx);
+
+		for (int l = 0; l < k; l++) {	// extract the k-th closest points
+			dd[i*k + l] = ctx.pointMK->ith_smallest_key(l);
+			nn_idx[i*k + l] = ctx.pointMK->ith_smallest_info(l);
+		}
+		delete ctx.pointMK;				// deallocate closest point set
+	}
+}
+
+//----------------------------------------------------------------------
+//	Search threads
+//		Each thread searches one contiguous run of the sorted queries.
+//----------------------------------------------------------------------
+
+struct ANNkdBatchJob {
+	ANNkd_tree			*tree;			// the tree searched
+	ANNpointArray		qa;				// the query points
+	const int			*order;			// query indices in search order
+	int					begin;			// first position in order
+	int					end;			// one past last position in order
+	int					k;				// number of near neighbors
+	ANNidxArray			nn_idx;			// nearest neighbor indices
+	ANNdistArray		dd;				// distances to near neighbors
+	double				eps;			// the error bound
+};
+
+void* annkBatchThread(void* arg)
+{
+	ANNkdBatchJob *job = (ANNkdBatchJob *) arg;
+	job->tree->annkSearchOrdered(job->qa, job->order, job->begin, job->end,
+				job->k, job->nn_idx, job->dd, job->eps);
+	return NULL;
+}
+
+//----------------------------------------------------------------------
+//	annkSearchBatch - search for the k nearest neighbors of m points
+//----------------------------------------------------------------------
+
+void ANNkd_tree::annkSearchBatch(
+	ANNpointArray		qa,				// the query points
+	int					m,				// number of query points
+	int					k,				// number of near neighbors to return
+	ANNidxArray			nn_idx,			// nearest neighbor indices (returned)
+	ANNdistArray		dd,				// the approximate nearest neighbors
+	double				eps,			// the error bound
+	int					n_threads)		// number of search threads
+{
+	if (k > n_pts) {					// too many near neighbors?
+		annError("Requesting more near neighbors than data points", ANNabort);
+	}
+	if (m <= 0) return;
+
+										// sort the queries by Morton code
+	int nd = (dim < 3) ? dim : 3;		// coordinates used for the code
+	int bits = 63 / nd;					// bits per coordinate
+	if (bits > 32) bits = 32;
+
+	vector< pair<ANNmorton, int> > codes(m);
+	for (int i = 0; i < m; i++) {
+		codes[i].first = annMortonCode(qa[i], bnd_box_lo, bnd_box_hi, nd, bits);
+		codes[i].second = i;
+	}
+	sort(codes.begin(), codes.end());
+
+	vector<int> order(m);
+	for (int i = 0; i < m; i++) {
+		order[i] = codes[i].second;
+	}
+
+	if (n_threads > m) n_threads = m;
+#ifdef _WIN32
+	n_threads = 1;						// no threads on this platform
+#endif
+	if (n_threads <= 1) {
+		annkSearchOrdered(qa, &order[0], 0, m, k, nn_idx, dd, eps);
+		return;
+	}
+
+	vector<ANNkdBatchJob> jobs(n_threads);
+	for (int b = 0; b < n_threads; b++) {
+		jobs[b].tree = this;
+		jobs[b].qa = qa;
+		jobs[b].order = &order[0];
+		jobs[b].begin = (int) ((long long) m * b / n_threads);
+		jobs[b].end = (int) ((long long) m * (b+1) / n_threads);
+		jobs[b].k = k;
+		jobs[b].nn_idx = nn_idx;
+		jobs[b].dd = dd;
+		jobs[b].eps = eps;
+	}
+
+#ifndef _WIN32
+	vector<pthread_t> threads(n_threads);
+	int started = 0;					// threads 1 .. started are running
+	for (int b = 1; b < n_threads; b++) {
+		if (pthread_create(&threads[b], NULL, annkBatchThread, &jobs[b]) != 0) {
+			break;
+		}
+		started = b;
+	}
+	annkBatchThread(&jobs[0]);			// first run on the calling thread
+	for (int b = 1; b <= started; b++) {
+		pthread_join(threads[b], NULL);
+	}
+	for (int b = started+1; b < n_threads; b++) {
+		annkBatchThread(&jobs[b]);		// runs without a thread
+	}
+#endif
+}
@@ -32,13 +32,20 @@
 #include <ANN/ANNperf.h>				// performance evaluation
 
 //----------------------------------------------------------------------
-//	Global variables
-//		These are active for the life of each call to
-//		annRangeSearch().  They are set to save the number of
-//		variables that need to be passed among the various search
-//		procedures.
+//	ANNkdFRSearchCtx
+//		State of one call to annkFRSearch(), shared by the recursive
+//		search procedures (formerly global variables).
 //----------------------------------------------------------------------
 
-extern ANNpoint			ANNkdFRQ;			// query point (static copy)
+struct ANNkdFRSearchCtx {
+	int				dim;				// dimension of space
+	ANNpoint		q;					// query point
+	ANNdist			sqRad;				// squared radius search bound
+	double			maxErr;				// max tolerable squared error
+	ANNpointArray	pts;				// the points
+	ANNmin_k		*pointMK;			// set of k closest points
+	int				ptsVisited;			// total points visited
+	int				ptsInRange;			// number of points in the range
+};
 
 #endif
@@ -0,0 +1,384 @@
+//----------------------------------------------------------------------
+// File:			kd_flat.cpp
+// Programmer:		Sunil Arya and David Mount
+// Description:		Flattened kd-tree (contiguous node and bucket arrays)
+// Last modified:	01/04/05 (Version 1.0)
+//----------------------------------------------------------------------
+// Copyright (c) 1997-2005 University of Maryland and Sunil Arya and
+// David Mount.  All Rights Reserved.
+//
+// This software and related documentation is part of the Approximate
+// Nearest Neighbor Library (ANN).  This software is provided under
+// the provisions of the Lesser GNU Public License (LGPL).  See the
+// file ../ReadMe.txt for further information.
+//
+// The University of Maryland (U.M.) and the authors make no
+// representations about the suitability or fitness of this software for
+// any purpose.  It is provided "as is" without express or implied
+// warranty.
+//----------------------------------------------------------------------
+// History:
+//	Flattened kd-tree added for GICP.
+//----------------------------------------------------------------------
+
+#include "kd_flat.h"					// flattened kd-tree declarations
+#include "kd_util.h"					// kd-tree utilities
+
+#include <ANN/ANNperf.h>				// performance evaluation
+
+//----------------------------------------------------------------------
+//	Flattening
+//		The tree is traversed in breadth-first order.  Each node
+//		writes itself to its slot of the node array; a splitting node
+//		appends its children to the queue, which assigns them the next
+//		two slots, and a leaf copies its points to the bucket arrays.
+//		Only kd-tree nodes can be flattened.
+//----------------------------------------------------------------------
+
+void ANNkd_node::flatten(ANNflatBuilder &fb, int slot)
+{
+	annError("Only kd-trees (without shrinking nodes) can be flattened", ANNabort);
+}
+
+void ANNkd_split::flatten(ANNflatBuilder &fb, int slot)
+{
+	ANNflat_node &nd = fb.nodes[slot];
+	nd.cut_dim = cut_dim;
+	nd.cut_val = cut_val;
+	nd.cd_bnds[ANN_LO] = cd_bnds[ANN_LO];
+	nd.cd_bnds[ANN_HI] = cd_bnds[ANN_HI];
+	nd.n_pts = 0;
+	nd.first = (int) fb.queue.size();	// slots of the children
+	fb.queue.push_back(child[ANN_LO]);
+	fb.queue.push_back(child[ANN_HI]);
+}
+
+void ANNkd_leaf::flatten(ANNflatBuilder &fb, int slot)
+{
+	ANNflat_node &nd = fb.nodes[slot];
+	nd.cut_dim = -1;
+	nd.cut_val = 0;
+	nd.cd_bnds[ANN_LO] = nd.cd_bnds[ANN_HI] = 0;
+	nd.n_pts = n_pts;
+	nd.first = (int) fb.bkt_idx.size();	// points follow the previous leaf
+	for (int i = 0; i < n_pts; i++) {
+		fb.bkt_idx.push_back(bkt[i]);
+		for (int d = 0; d < fb.dim; d++) {
+			fb.bkt_pts.push_back(fb.pts[bkt[i]][d]);
+		}
+	}
+}
+
+void ANNkd_flat_tree::Flatten(
+	ANNkd_tree			&tree)			// the tree
+{
+	dim = tree.dim;
+	n_pts = tree.n_pts;
+	pts = tree.pts;
+	in_image = ANNfalse;
+	if (tree.bnd_box_lo != NULL) {
+		bnd_box_lo = annCopyPt(dim, tree.bnd_box_lo);
+		bnd_box_hi = annCopyPt(dim, tree.bnd_box_hi);
+	}
+	else {								// empty tree has no bounding box
+		bnd_box_lo = annAllocPt(dim);
+		bnd_box_hi = annAllocPt(dim);
+	}
+
+	ANNflatBuilder fb;
+	fb.dim = dim;
+	fb.pts = pts;
+	fb.bkt_pts.reserve(dim*n_pts);
+	fb.bkt_idx.reserve(n_pts);
+	if (tree.root != NULL) {
+		fb.queue.push_back(tree.root);
+	}
+	for (int i = 0; i < (int) fb.queue.size(); i++) {
+		fb.nodes.resize(fb.queue.size());
+		fb.queue[i]->flatten(fb, i);
+	}
+										// copy to the final arrays
+	n_nodes = (int) fb.nodes.size();
+	nodes = new ANNflat_node[n_nodes > 0 ? n_nodes : 1];
+	bkt_pts = new ANNcoord[fb.bkt_pts.size() > 0 ? fb.bkt_pts.size() : 1];
+	bkt_idx = new ANNidx[fb.bkt_idx.size() > 0 ? fb.bkt_idx.size() : 1];
+	for (int i = 0; i < n_nodes; i++) {
+		nodes[i] = fb.nodes[i];
+	}
+	for (int i = 0; i < (int) fb.bkt_pts.size(); i++) {
+		bkt_pts[i] = fb.bkt_pts[i];
+	}
+	for (int i = 0; i < (int) fb.bkt_idx.size(); i++) {
+		bkt_idx[i] = fb.bkt_idx[i];
+	}
+}
+
+//----------------------------------------------------------------------
+//	Constructors and destructor
+//----------------------------------------------------------------------
+
+ANNkd_flat_tree::ANNkd_flat_tree(		// build from point array
+	ANNpointArray		pa,				// point array
+	int					n,				// number of points
+	int					dd,				// dimension
+	int					bs,				// bucket size
+	ANNsplitRule		split)			// splitting method
+{
+	ANNkd_tree tree(pa, n, dd, bs, split);
+	Flatten(tree);
+}
+
+ANNkd_flat_tree::ANNkd_flat_tree(		// flatten an existing kd-tree
+	ANNkd_tree			&tree)			// the tree
+{
+	Flatten(tree);
+}
+
+ANNkd_flat_tree::~ANNkd_flat_tree()		// tree destructor
+{
+	if (in_image) return;				// the arrays belong to the image
+	delete [] nodes;
+	delete [] bkt_pts;
+	delete [] bkt_idx;
+	annDeallocPt(bnd_box_lo);
+	annDeallocPt(bnd_box_hi);
+}
+
+//----------------------------------------------------------------------
+//	Standard search
+//		The same algorithm as ANNkd_split::ann_search() and
+//		ANNkd_leaf::ann_search() (see kd_search.cpp), on the arrays.
+//----------------------------------------------------------------------
+
+static void annFlatSearch(int node, ANNdist box_dist, ANNflatSearchCtx &ctx)
+{
+	const ANNflat_node &nd = ctx.nodes[node];
+
+	if (nd.cut_dim < 0) {				// leaf node
+		register ANNdist dist;			// distance to data point
+		register const ANNcoord* pp;	// data coordinate pointer
+		register ANNcoord* qq;			// query coordinate pointer
+		register ANNdist min_dist;		// distance to k-th closest point
+		register ANNcoord t;
+		register int d;
+
+		min_dist = ctx.pointMK->max_key(); // k-th smallest distance so far
+		pp = ctx.bkt_pts + nd.first*ctx.dim;
+
+		for (int i = 0; i < nd.n_pts; i++, pp += ctx.dim) {
+			qq = ctx.q;					// first coord of query point
+			dist = 0;
+
+			for(d = 0; d < ctx.dim; d++) {
+				ANN_COORD(1)			// one more coordinate hit
+				ANN_FLOP(4)				// increment floating ops
+
+				t = qq[d] - pp[d];		// compute length
+										// exceeds dist to k-th smallest?
+				if( (dist = ANN_SUM(dist, ANN_POW(t))) > min_dist) {
+					break;
+				}
+			}
+
+			if (d >= ctx.dim &&			// among the k best?
+			   (ANN_ALLOW_SELF_MATCH || dist!=0)) { // and no self-match problem
+										// add it to the list
+				ctx.pointMK->insert(dist, ctx.bkt_idx[nd.first + i]);
+				min_dist = ctx.pointMK->max_key();
+			}
+		}
+		ANN_LEAF(1)						// one more leaf node visited
+		ANN_PTS(nd.n_pts)				// increment points visited
+		ctx.ptsVisited += nd.n_pts;		// increment number of points visited
+		return;
+	}
+										// check dist calc term condition
+	if (ANNmaxPtsVisited != 0 && ctx.ptsVisited > ANNmaxPtsVisited) return;
+
+										// distance to cutting plane
+	ANNcoord cut_diff = ctx.q[nd.cut_dim] - nd.cut_val;
+
+	if (cut_diff < 0) {					// left of cutting plane
+		annFlatSearch(nd.first + ANN_LO, box_dist, ctx);// visit closer child first
+
+		ANNcoord box_diff = nd.cd_bnds[ANN_LO] - ctx.q[nd.cut_dim];
+		if (box_diff < 0)				// within bounds - ignore
+			box_diff = 0;
+										// distance to further box
+		box_dist = (ANNdist) ANN_SUM(box_dist,
+				ANN_DIFF(ANN_POW(box_diff), ANN_POW(cut_diff)));
+
+										// visit further child if close enough
+		if (box_dist * ctx.maxErr < ctx.pointMK->max_key())
+			annFlatSearch(nd.first + ANN_HI, box_dist, ctx);
+	}
+	else {								// right of cutting plane
+		annFlatSearch(nd.first + ANN_HI, box_dist, ctx);// visit closer child first
+
+		ANNcoord box_diff = ctx.q[nd.cut_dim] - nd.cd_bnds[ANN_HI];
+		if (box_diff < 0)				// within bounds - ignore
+			box_diff = 0;
+										// distance to further box
+		box_dist = (ANNdist) ANN_SUM(box_dist,
+				ANN_DIFF(ANN_POW(box_diff), ANN_POW(cut_diff)));
+
+										// visit further child if close enough
+		if (box_dist * ctx.maxErr < ctx.pointMK->max_key())
+			annFlatSearch(nd.first + ANN_LO, box_dist, ctx);
+	}
+	ANN_FLOP(10)						// increment floating ops
+	ANN_SPL(1)							// one more splitting node visited
+}
+
+void ANNkd_flat_tree::annkSearch(
+	ANNpoint			q,				// the query point
+	int					k,				// number of near neighbors to return
+	ANNidxArray			nn_idx,			// nearest neighbor indices (returned)
+	ANNdistArray		dd,				// the approximate nearest neighbor
+	double				eps)			// the error bound
+{
+	if (k > n_pts) {					// too many near neighbors?
+		annError("Requesting more near neighbors than data points", ANNabort);
+	}
+
+	ANNflatSearchCtx ctx;				// state of this search
+	ctx.dim = dim;
+	ctx.q = q;
+	ctx.nodes = nodes;
+	ctx.bkt_pts = bkt_pts;
+	ctx.bkt_idx = bkt_idx;
+	ctx.ptsVisited = 0;
+	ctx.maxErr = ANN_POW(1.0 + eps);
+	ANN_FLOP(2)							// increment floating op count
+
+	ctx.pointMK = new ANNmin_k(k);		// create set for closest k points
+	if (n_nodes > 0) {					// search starting at the root
+		annFlatSearch(0, annBoxDistance(q, bnd_box_lo, bnd_box_hi, dim), ctx);
+	}
+
+	for (int i = 0; i < k; i++) {		// extract the k-th closest points
+		dd[i] = ctx.pointMK->ith_smallest_key(i);
+		nn_idx[i] = ctx.pointMK->ith_smallest_info(i);
+	}
+	delete ctx.pointMK;					// deallocate closest point set
+}
+
+//----------------------------------------------------------------------
+//	Fixed-radius search
+//		The same algorithm as ANNkd_split::ann_FR_search() and
+//		ANNkd_leaf::ann_FR_search() (see kd_fix_rad_search.cpp).
+//----------------------------------------------------------------------
+
+static void annFlatFRSearch(int node, ANNdist box_dist, ANNflatSearchCtx &ctx)
+{
+	const ANNflat_node &nd = ctx.nodes[node];
+
+	if (nd.cut_dim < 0) {				// leaf node
+		register ANNdist dist;			// distance to data point
+		register const ANNcoord* pp;	// data coordinate pointer
+		register ANNcoord* qq;			// query coordinate pointer
+		register ANNcoord t;
+		register int d;
+
+		pp = ctx.bkt_pts + nd.first*ctx.dim;
+
+		for (int i = 0; i < nd.n_pts; i++, pp += ctx.dim) {
+			qq = ctx.q;					// first coord of query point
+			dist = 0;
+
+			for(d = 0; d < ctx.dim; d++) {
+				ANN_COORD(1)			// one more coordinate hit
+				ANN_FLOP(5)				// increment floating ops
+
+				t = qq[d] - pp[d];		// compute length
+										// exceeds dist to k-th smallest?
+				if( (dist = ANN_SUM(dist, ANN_POW(t))) > ctx.sqRad) {
+					break;
+				}
+			}
+
+			if (d >= ctx.dim &&			// among the k best?
+			   (ANN_ALLOW_SELF_MATCH || dist!=0)) { // and no self-match problem
+										// add it to the list
+				ctx.pointMK->insert(dist, ctx.bkt_idx[nd.first + i]);
+				ctx.ptsInRange++;		// increment point count
+			}
+		}
+		ANN_LEAF(1)						// one more leaf node visited
+		ANN_PTS(nd.n_pts)				// increment points visited
+		ctx.ptsVisited += nd.n_pts;		// increment number of points visited
+		return;
+	}
+										// check dist calc term condition
+	if (ANNmaxPtsVisited != 0 && ctx.ptsVisited > ANNmaxPtsVisited) return;
+
+										// distance to cutting plane
+	ANNcoord cut_diff = ctx.q[nd.cut_dim] - nd.cut_val;
+
+	if (cut_diff < 0) {					// left of cutting plane
+		annFlatFRSearch(nd.first + ANN_LO, box_dist, ctx);// visit closer child first
+
+		ANNcoord box_diff = nd.cd_bnds[ANN_LO] - ctx.q[nd.cut_dim];
+		if (box_diff < 0)				// within bounds - ignore
+			box_diff = 0;
+										// distance to further box
+		box_dist = (ANNdist) ANN_SUM(box_dist,
+				ANN_DIFF(ANN_POW(box_diff), ANN_POW(cut_diff)));
+
+										// visit further child if in range
+		if (box_dist * ctx.maxErr <= ctx.sqRad)
+			annFlatFRSearch(nd.first + ANN_HI, box_dist, ctx);
+	}
+	else {								// right of cutting plane
+		annFlatFRSearch(nd.first + ANN_HI, box_dist, ctx);// visit closer child first
+
+		ANNcoord box_diff = ctx.q[nd.cut_dim] - nd.cd_bnds[ANN_HI];
+		if (box_diff < 0)				// within bounds - ignore
+			box_diff = 0;
+										// distance to further box
+		box_dist = (ANNdist) ANN_SUM(box_dist,
+				ANN_DIFF(ANN_POW(box_diff), ANN_POW(cut_diff)));
+
+										// visit further child if in range
+		if (box_dist * ctx.maxErr <= ctx.sqRad)
+			annFlatFRSearch(nd.first + ANN_LO, box_dist, ctx);
+	}
+	ANN_FLOP(13)						// increment floating ops
+	ANN_SPL(1)							// one more splitting node visited
+}
+
+int ANNkd_flat_tree::annkFRSearch(
+	ANNpoint			q,				// the query point
+	ANNdist				sqRad,			// squared radius search bound
+	int					k,				// number of near neighbors to return
+	ANNidxArray			nn_idx,			// nearest neighbor indices (returned)
+	ANNdistArray		dd,				// the approximate nearest neighbor
+	double				eps)			// the error bound
+{
+	ANNflatSearchCtx ctx;				// state of this search
+	ctx.dim = dim;
+	ctx.q = q;
+	ctx.sqRad = sqRad;
+	ctx.nodes = nodes;
+	ctx.bkt_pts = bkt_pts;
+	ctx.bkt_idx = bkt_idx;
+	ctx.ptsVisited = 0;					// initialize count of points visited
+	ctx.ptsInRange = 0;					// ...and points in the range
+	ctx.maxErr = ANN_POW(1.0 + eps);
+	ANN_FLOP(2)							// increment floating op count
+
+	ctx.pointMK = new ANNmin_k(k);		// create set for closest k points
+	if (n_nodes > 0) {					// search starting at the root
+		annFlatFRSearch(0, annBoxDistance(q, bnd_box_lo, bnd_box_hi, dim), ctx);
+	}
+
+	for (int i = 0; i < k; i++) {		// extract the k-th closest points
+		if (dd != NULL)
+			dd[i] = ctx.pointMK->ith_smallest_key(i);
+		if (nn_idx != NULL)
+			nn_idx[i] = ctx.pointMK->ith_smallest_info(i);
+	}
+
+	delete ctx.pointMK;					// deallocate closest point set
+	return ctx.ptsInRange;				// return final point count
+}
@@ -0,0 +1,88 @@
+//----------------------------------------------------------------------
+// File:			kd_flat.h
+// Programmer:		Sunil Arya and David Mount
+// Description:		Flattened kd-tree (contiguous node and bucket arrays)
+// Last modified:	01/04/05 (Version 1.0)
+//----------------------------------------------------------------------
+// Copyright (c) 1997-2005 University of Maryland and Sunil Arya and
+// David Mount.  All Rights Reserved.
+//
+// This software and related documentation is part of the Approximate
+// Nearest Neighbor Library (ANN).  This software is provided under
+// the provisions of the Lesser GNU Public License (LGPL).  See the
+// file ../ReadMe.txt for further information.
+//
+// The University of Maryland (U.M.) and the authors make no
+// representations about the suitability or fitness of this software for
+// any purpose.  It is provided "as is" without express or implied
+// warranty.
+//----------------------------------------------------------------------
+// History:
+//	Flattened kd-tree added for GICP.
+//----------------------------------------------------------------------
+
+#ifndef ANN_kd_flat_H
+#define ANN_kd_flat_H
+
+#include "kd_tree.h"					// kd-tree declarations
+#include "pr_queue_k.h"					// k-element priority queue
+
+#include <vector>						// vector
+
+//----------------------------------------------------------------------
+//	ANNflat_node
+//		A node of a flattened kd-tree.  The nodes are stored in one
+//		array in breadth-first order, so the two children of a
+//		splitting node are adjacent and a single index locates both.
+//		The points of a leaf are stored contiguously in the bucket
+//		arrays of the tree.
+//----------------------------------------------------------------------
+
+struct ANNflat_node {
+	int				cut_dim;			// cutting dimension (-1 for leaves)
+	int				first;				// splitting node: low child (high
+										// child is first+1); leaf: first
+										// point in the bucket arrays
+	int				n_pts;				// leaf: number of points
+	ANNcoord		cut_val;			// location of cutting plane
+	ANNcoord		cd_bnds[2];			// lower and upper bounds of
+										// rectangle along cut_dim
+};
+
+//----------------------------------------------------------------------
+//	ANNflatBuilder
+//		State of the conversion of a pointer-based kd-tree into a
+//		flattened one.  Position i of the queue holds the node that is
+//		written to nodes[i], so appending the children of a node to the
+//		queue assigns their (breadth-first) slots.
+//----------------------------------------------------------------------
+
+struct ANNflatBuilder {
+	int						dim;		// dimension of space
+	ANNpointArray			pts;		// the points
+	std::vector<ANNkd_ptr>	queue;		// nodes in breadth-first order
+	std::vector<ANNflat_node> nodes;	// the flattened nodes
+	std::vector<ANNcoord>	bkt_pts;	// coordinates of bucket points
+	std::vector<ANNidx>		bkt_idx;	// indices of bucket points
+};
+
+//----------------------------------------------------------------------
+//	ANNflatSearchCtx
+//		State of one search of a flattened kd-tree, shared by the
+//		recursive search procedures.
+//----------------------------------------------------------------------
+
+struct ANNflatSearchCtx {
+	int				dim;				// dimension of space
+	ANNpoint		q;					// query point
+	double			maxErr;				// max tolerable squared error
+	ANNdist			sqRad;				// squared radius (fixed-radius)
+	const ANNflat_node	*nodes;			// the nodes
+	const ANNcoord	*bkt_pts;			// coordinates of bucket points
+	const ANNidx	*bkt_idx;			// indices of bucket points
+	ANNmin_k		*pointMK;			// set of k closest points
+	int				ptsVisited;			// number of points visited
+	int				ptsInRange;			// number of points in the range
+};
+
+#endif
@@ -0,0 +1,245 @@
+//----------------------------------------------------------------------
+// File:			kd_flat_dump.cpp
+// Programmer:		Sunil Arya and David Mount
+// Description:		Binary images of flattened kd-trees
+// Last modified:	01/04/05 (Version 1.0)
+//----------------------------------------------------------------------
+// Copyright (c) 1997-2005 University of Maryland and Sunil Arya and
+// David Mount.  All Rights Reserved.
+//
+// This software and related documentation is part of the Approximate
+// Nearest Neighbor Library (ANN).  This software is provided under
+// the provisions of the Lesser GNU Public License (LGPL).  See the
+// file ../ReadMe.txt for further information.
+//
+// The University of Maryland (U.M.) and the authors make no
+// representations about the suitability or fitness of this software for
+// any purpose.  It is provided "as is" without express or implied
+// warranty.
+//----------------------------------------------------------------------
+// History:
+//	Binary images added for GICP.
+//----------------------------------------------------------------------
+// Unlike Dump() (see kd_dump.cpp), which prints the tree as text that
+// has to be parsed and rebuilt node by node, the binary image holds the
+// arrays of a flattened tree exactly as they are searched.  Loading it
+// only checks the header and sets a few pointers.
+//----------------------------------------------------------------------
+
+#include "kd_flat.h"					// flattened kd-tree declarations
+
+#include <string.h>						// memcmp, memcpy
+
+//----------------------------------------------------------------------
+//	Image layout
+//		The header is followed by the nodes, the bounding box (low and
+//		high point), the bucket coordinates and the bucket indices.
+//		Every part starts at a multiple of 8 bytes from the start of
+//		the image.  There are no pointers, only these offsets, which
+//		follow from the counts in the header.
+//
+//		Any change of the layout or of ANNflat_node must increment
+//		ANN_FLAT_IMAGE_VERSION.
+//----------------------------------------------------------------------
+
+const char		ANN_FLAT_IMAGE_MAGIC[8] = {'A','N','N','F','L','A','T','\0'};
+const int		ANN_FLAT_IMAGE_VERSION	= 1;
+const int		ANN_FLAT_BYTE_ORDER		= 0x01020304;	// reads differently
+														// on other machines
+const size_t	ANN_FLAT_ALIGN			= 8;	// alignment of the parts
+
+struct ANNflatImageHeader {
+	char			magic[8];			// ANN_FLAT_IMAGE_MAGIC
+	int				version;			// ANN_FLAT_IMAGE_VERSION
+	int				byte_order;			// ANN_FLAT_BYTE_ORDER
+	int				coord_size;			// sizeof(ANNcoord)
+	int				idx_size;			// sizeof(ANNidx)
+	int				node_size;			// sizeof(ANNflat_node)
+	int				dim;				// dimension of space
+	int				n_pts;				// number of points
+	int				n_nodes;			// number of nodes
+};
+
+enum {ANN_IMG_NODES, ANN_IMG_BOX_LO, ANN_IMG_BOX_HI, ANN_IMG_BKT_PTS,
+	  ANN_IMG_BKT_IDX, ANN_IMG_END};	// parts of an image
+
+static size_t annAlign(size_t offset)
+{
+	return (offset + ANN_FLAT_ALIGN - 1) / ANN_FLAT_ALIGN * ANN_FLAT_ALIGN;
+}
+
+static void annFlatImageLayout(			// offsets of the parts of an image
+	int					dim,			// dimension of space
+	int					n_pts,			// number of points
+	int					n_nodes,		// number of nodes
+	size_t				*offset)		// ANN_IMG_END+1 offsets (returned)
+{
+	offset[ANN_IMG_NODES]	= annAlign(sizeof(ANNflatImageHeader));
+	offset[ANN_IMG_BOX_LO]	= annAlign(offset[ANN_IMG_NODES] +
+										(size_t) n_nodes*sizeof(ANNflat_node));
+	offset[ANN_IMG_BOX_HI]	= annAlign(offset[ANN_IMG_BOX_LO] +
+										(size_t) dim*sizeof(ANNcoord));
+	offset[ANN_IMG_BKT_PTS]	= annAlign(offset[ANN_IMG_BOX_HI] +
+										(size_t) dim*sizeof(ANNcoord));
+	offset[ANN_IMG_BKT_IDX]	= annAlign(offset[ANN_IMG_BKT_PTS] +
+										(size_t) dim*n_pts*sizeof(ANNcoord));
+	offset[ANN_IMG_END]		= annAlign(offset[ANN_IMG_BKT_IDX] +
+										(size_t) n_pts*sizeof(ANNidx));
+}
+
+//----------------------------------------------------------------------
+//	isImage
+//		Checks that the memory holds a complete image of the current
+//		version that was written on a compatible machine, and that the
+//		nodes only refer to nodes and points within the image, so that
+//		a corrupt image cannot make the search read outside of it.
+//		The children of a node follow it (breadth-first order), which
+//		also rules out cycles.
+//----------------------------------------------------------------------
+
+ANNbool ANNkd_flat_tree::isImage(
+	const void			*image,			// the image
+	size_t				size)			// size of the image in bytes
+{
+	if (image == NULL || size < sizeof(ANNflatImageHeader) ||
+		(size_t) image % ANN_FLAT_ALIGN != 0) {
+		return ANNfalse;
+	}
+	const ANNflatImageHeader *hdr = (const ANNflatImageHeader *) image;
+	if (memcmp(hdr->magic, ANN_FLAT_IMAGE_MAGIC, sizeof(hdr->magic)) != 0 ||
+		hdr->version != ANN_FLAT_IMAGE_VERSION ||
+		hdr->byte_order != ANN_FLAT_BYTE_ORDER ||
+		hdr->coord_size != (int) sizeof(ANNcoord) ||
+		hdr->idx_size != (int) sizeof(ANNidx) ||
+		hdr->node_size != (int) sizeof(ANNflat_node) ||
+		hdr->dim < 1 || hdr->n_pts < 0 || hdr->n_nodes < 0) {
+		return ANNfalse;
+	}
+	size_t offset[ANN_IMG_END+1];
+	annFlatImageLayout(hdr->dim, hdr->n_pts, hdr->n_nodes, offset);
+	if (offset[ANN_IMG_END] > size) {
+		return ANNfalse;
+	}
+
+	const char *base = (const char *) image;
+	const ANNflat_node *nodes = (const ANNflat_node *) (base + offset[ANN_IMG_NODES]);
+	for (int i = 0; i < hdr->n_nodes; i++) {
+		const ANNflat_node &nd = nodes[i];
+		if (nd.cut_dim >= 0) {			// splitting node
+			if (nd.cut_dim >= hdr->dim || nd.first <= i ||
+				nd.first >= hdr->n_nodes - 1) {
+				return ANNfalse;
+			}
+		}
+		else if (nd.cut_dim != -1 ||	// leaf
+				 nd.first < 0 || nd.n_pts < 0 ||
+				 nd.n_pts > hdr->n_pts - nd.first) {
+			return ANNfalse;
+		}
+	}
+	const ANNidx *bkt_idx = (const ANNidx *) (base + offset[ANN_IMG_BKT_IDX]);
+	for (int i = 0; i < hdr->n_pts; i++) {
+		if (bkt_idx[i] < 0 || bkt_idx[i] >= hdr->n_pts) {
+			return ANNfalse;
+		}
+	}
+	return ANNtrue;
+}
+
+//----------------------------------------------------------------------
+//	imageSize and Save
+//----------------------------------------------------------------------
+
+size_t ANNkd_flat_tree::imageSize()
+{
+	size_t offset[ANN_IMG_END+1];
+	annFlatImageLayout(dim, n_pts, n_nodes, offset);
+	return offset[ANN_IMG_END];
+}
+
+static void annWritePart(				// write a part of the image
+	std::ostream		&out,			// output stream
+	size_t				&pos,			// bytes written so far (modified)
+	size_t				offset,			// start of the part
+	const void			*data,			// the data
+	size_t				size)			// size of the data
+{
+	static const char zeros[ANN_FLAT_ALIGN] = {0};
+	out.write(zeros, offset - pos);		// padding
+	out.write((const char *) data, size);
+	pos = offset + size;
+}
+
+void ANNkd_flat_tree::Save(				// write the binary image
+	std::ostream		&out)			// output stream
+{
+	ANNflatImageHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));		// no uninitialized padding bytes
+	memcpy(hdr.magic, ANN_FLAT_IMAGE_MAGIC, sizeof(hdr.magic));
+	hdr.version		= ANN_FLAT_IMAGE_VERSION;
+	hdr.byte_order	= ANN_FLAT_BYTE_ORDER;
+	hdr.coord_size	= sizeof(ANNcoord);
+	hdr.idx_size	= sizeof(ANNidx);
+	hdr.node_size	= sizeof(ANNflat_node);
+	hdr.dim			= dim;
+	hdr.n_pts		= n_pts;
+	hdr.n_nodes		= n_nodes;
+
+	size_t offset[ANN_IMG_END+1];
+	annFlatImageLayout(dim, n_pts, n_nodes, offset);
+	size_t pos = 0;
+	annWritePart(out, pos, 0, &hdr, sizeof(hdr));
+	annWritePart(out, pos, offset[ANN_IMG_NODES], NULL, 0);
+	for (int i = 0; i < n_nodes; i++) {	// field by field, so that the
+		ANNflat_node nd;				// padding is written as zeros
+		memset(&nd, 0, sizeof(nd));
+		nd.cut_dim		= nodes[i].cut_dim;
+		nd.first		= nodes[i].first;
+		nd.n_pts		= nodes[i].n_pts;
+		nd.cut_val		= nodes[i].cut_val;
+		nd.cd_bnds[ANN_LO] = nodes[i].cd_bnds[ANN_LO];
+		nd.cd_bnds[ANN_HI] = nodes[i].cd_bnds[ANN_HI];
+		out.write((const char *) &nd, sizeof(nd));
+	}
+	pos += (size_t) n_nodes*sizeof(ANNflat_node);
+	annWritePart(out, pos, offset[ANN_IMG_BOX_LO], bnd_box_lo,
+					(size_t) dim*sizeof(ANNcoord));
+	annWritePart(out, pos, offset[ANN_IMG_BOX_HI], bnd_box_hi,
+					(size_t) dim*sizeof(ANNcoord));
+	annWritePart(out, pos, offset[ANN_IMG_BKT_PTS], bkt_pts,
+					(size_t) dim*n_pts*sizeof(ANNcoord));
+	annWritePart(out, pos, offset[ANN_IMG_BKT_IDX], bkt_idx,
+					(size_t) n_pts*sizeof(ANNidx));
+	annWritePart(out, pos, offset[ANN_IMG_END], NULL, 0);
+}
+
+//----------------------------------------------------------------------
+//	Image constructor
+//		The arrays of the tree point into the image.  The searches do
+//		not modify them, so the image may be mapped read-only.
+//----------------------------------------------------------------------
+
+ANNkd_flat_tree::ANNkd_flat_tree(		// search a binary image in place
+	const void			*image,			// the image
+	size_t				size)			// size of the image in bytes
+{
+	if (!isImage(image, size)) {
+		annError("Invalid or incompatible image of a flattened kd-tree", ANNabort);
+	}
+	const ANNflatImageHeader *hdr = (const ANNflatImageHeader *) image;
+	char *base = (char *) image;		// not written to
+
+	dim = hdr->dim;
+	n_pts = hdr->n_pts;
+	n_nodes = hdr->n_nodes;
+	pts = NULL;							// the points are not in the image
+	in_image = ANNtrue;
+
+	size_t offset[ANN_IMG_END+1];
+	annFlatImageLayout(dim, n_pts, n_nodes, offset);
+	nodes		= (ANNflat_node *) (base + offset[ANN_IMG_NODES]);
+	bnd_box_lo	= (ANNpoint) (base + offset[ANN_IMG_BOX_LO]);
+	bnd_box_hi	= (ANNpoint) (base + offset[ANN_IMG_BOX_HI]);
+	bkt_pts		= (ANNcoord *) (base + offset[ANN_IMG_BKT_PTS]);
+	bkt_idx		= (ANNidxArray) (base + offset[ANN_IMG_BKT_IDX]);
+}
@@ -33,17 +33,19 @@
 #include <ANN/ANNperf.h>				// performance evaluation
 
 //----------------------------------------------------------------------
-//	Global variables
-//		Active for the life of each call to Appx_Near_Neigh() or
-//		Appx_k_Near_Neigh().
+//	ANNprSearchCtx
+//		State of one call to annkPriSearch(), shared by the
+//		search procedures (formerly global variables).
 //----------------------------------------------------------------------
 
-extern double			ANNprEps;		// the error bound
-extern int				ANNprDim;		// dimension of space
-extern ANNpoint			ANNprQ;			// query point
-extern double			ANNprMaxErr;	// max tolerable squared error
-extern ANNpointArray	ANNprPts;		// the points
-extern ANNpr_queue		*ANNprBoxPQ;	// priority queue for boxes
-extern ANNmin_k			*ANNprPointMK;	// set of k closest points
+struct ANNprSearchCtx {
+	int				dim;				// dimension of space
+	ANNpoint		q;					// query point
+	double			maxErr;				// max tolerable squared error
+	ANNpointArray	pts;				// the points
+	ANNpr_queue		*boxPQ;				// priority queue for boxes
+	ANNmin_k		*pointMK;			// set of k closest points
+	int				ptsVisited;			// number of points visited
+};
 
 #endif
@@ -32,17 +32,23 @@
 #include <ANN/ANNperf.h>				// performance evaluation
 
 //----------------------------------------------------------------------
-//	More global variables
-//		These are active for the life of each call to annkSearch(). They
-//		are set to save the number of variables that need to be passed
-//		among the various search procedures.
+//	ANNkdSearchCtx
+//		State of one call to annkSearch(), shared by the recursive
+//		search procedures (formerly global variables).
 //----------------------------------------------------------------------
 
-extern int				ANNkdDim;		// dimension of space (static copy)
-extern ANNpoint			ANNkdQ;			// query point (static copy)
-extern double			ANNkdMaxErr;	// max tolerable squared error
-extern ANNpointArray	ANNkdPts;		// the points (static copy)
-extern ANNmin_k			*ANNkdPointMK;	// set of k closest points
-extern int				ANNptsVisited;	// number of points visited
+struct ANNkdSearchCtx {
+	int				dim;				// dimension of space
+	ANNpoint		q;					// query point
+	double			maxErr;				// max tolerable squared error
+	ANNpointArray	pts;				// the points
+	ANNmin_k		*pointMK;			// set of k closest points
+	int				ptsVisited;			// number of points visited
+	ANNdist			bound;				// known bound on the k-th distance
+										// (ANN_DIST_INF if none)
+
+	ANNdist maxKey() const				// current k-th distance (or bound)
+		{  ANNdist mk = pointMK->max_key();  return mk < bound ? mk : bound;  }
+};
 
 #endif
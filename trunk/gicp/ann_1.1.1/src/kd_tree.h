@@ -31,6 +31,21 @@
 
 using namespace std;					// make std:: available
 
+//----------------------------------------------------------------------
+//	Search contexts
+//		The state of a single search (query point, closest points so
+//		far, ...) is passed down the recursive search procedures in
+//		a context object, which lives on the stack of the calling
+//		search function. Hence searches are re-entrant and several
+//		threads can search the same tree at once. The contexts are
+//		defined in kd_search.h, kd_pr_search.h and kd_fix_rad_search.h.
+//----------------------------------------------------------------------
+
+struct ANNkdSearchCtx;					// standard search
+struct ANNprSearchCtx;					// priority search
+struct ANNkdFRSearchCtx;				// fixed-radius search
+struct ANNflatBuilder;					// flattening of a kd-tree
+
 //----------------------------------------------------------------------
 //	Generic kd-tree node
 //
@@ -47,9 +62,9 @@ class ANNkd_node{						// generic kd-tree node (empty shell)
 public:
 	virtual ~ANNkd_node() {}					// virtual distroyer
 
-	virtual void ann_search(ANNdist) = 0;		// tree search
-	virtual void ann_pri_search(ANNdist) = 0;	// priority search
-	virtual void ann_FR_search(ANNdist) = 0;	// fixed-radius search
+	virtual void ann_search(ANNdist, ANNkdSearchCtx&) = 0;		// tree search
+	virtual void ann_pri_search(ANNdist, ANNprSearchCtx&) = 0;	// priority search
+	virtual void ann_FR_search(ANNdist, ANNkdFRSearchCtx&) = 0;	// fixed-radius search
 
 	virtual void getStats(						// get tree statistics
 				int dim,						// dimension of space
@@ -58,6 +73,8 @@ public:
 												// print node
 	virtual void print(int level, ostream &out) = 0;
 	virtual void dump(ostream &out) = 0;		// dump node
+												// flatten node (kd-tree only)
+	virtual void flatten(ANNflatBuilder &fb, int slot);
 
 	friend class ANNkd_tree;					// allow kd-tree to access us
 };
@@ -109,10 +126,11 @@ public:
 				ANNorthRect &bnd_box);			// bounding box
 	virtual void print(int level, ostream &out);// print node
 	virtual void dump(ostream &out);			// dump node
+	virtual void flatten(ANNflatBuilder &fb, int slot);	// flatten node
 
-	virtual void ann_search(ANNdist);			// standard search
-	virtual void ann_pri_search(ANNdist);		// priority search
-	virtual void ann_FR_search(ANNdist);		// fixed-radius search
+	virtual void ann_search(ANNdist, ANNkdSearchCtx&);			// standard search
+	virtual void ann_pri_search(ANNdist, ANNprSearchCtx&);		// priority search
+	virtual void ann_FR_search(ANNdist, ANNkdFRSearchCtx&);		// fixed-radius search
 };
 
 //----------------------------------------------------------------------
@@ -175,10 +193,11 @@ public:
 				ANNorthRect &bnd_box);			// bounding box
 	virtual void print(int level, ostream &out);// print node
 	virtual void dump(ostream &out);			// dump node
+	virtual void flatten(ANNflatBuilder &fb, int slot);	// flatten node
 
-	virtual void ann_search(ANNdist);			// standard search
-	virtual void ann_pri_search(ANNdist);		// priority search
-	virtual void ann_FR_search(ANNdist);		// fixed-radius search
+	virtual void ann_search(ANNdist, ANNkdSearchCtx&);			// standard search
+	virtual void ann_pri_search(ANNdist, ANNprSearchCtx&);		// priority search
+	virtual void ann_FR_search(ANNdist, ANNkdFRSearchCtx&);		// fixed-radius search
 };
 
 //----------------------------------------------------------------------
@@ -0,0 +1,230 @@
+/*************************************************************
+  Generalized-ICP Copyright (c) 2009 Aleksandr Segal.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with
+  or without modification, are permitted provided that the
+  following conditions are met:
+
+* Redistributions of source code must retain the above
+  copyright notice, this list of conditions and the
+  following disclaimer.
+* Redistributions in binary form must reproduce the above
+  copyright notice, this list of conditions and the
+  following disclaimer in the documentation and/or other
+  materials provided with the distribution.
+* The names of the contributors may not be used to endorse
+  or promote products derived from this software
+  without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+  PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+  DAMAGE.
+*************************************************************/
+
+// Compares the GICP kd-tree (kdtree.h) with ANN's kd-tree and flattened kd-tree on
+// synthetic depth camera clouds: build time, the k=2 searches of AlignScan (single and
+// batched) and the k=20 searches of ComputeMatrices. Also checks that all of them find
+// neighbours at the same distances.
+//
+// Not part of the regular build:
+//   g++ -O2 -I. -Iann_1.1.1/include bench_kdtree.cpp ann_1.1.1/lib/libANN.a -lpthread -o bench_kdtree
+//   ./bench_kdtree [num_points ...]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <sys/time.h>
+
+#include <ANN/ANN.h>
+#include "kdtree.h"
+
+using namespace std;
+using namespace dgc::gicp;
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+static double uniform() {
+  return rand()/(double)RAND_MAX;
+}
+
+// n points seen by a 640x480 depth camera: a floor, a back wall and a sphere, with noise
+static void make_cloud(int n, vector<float> &coords) {
+  coords.resize(3*n);
+  const double f = 525., cx = 319.5, cy = 239.5;
+  for(int i = 0; i < n; i++) {
+    double u = 640.*uniform(), v = 480.*uniform();
+    double dx = (u - cx)/f, dy = (v - cy)/f;
+    double depth = 4.; // back wall
+    if(dy > 0.) {
+      depth = min(depth, 1./dy); // floor 1 m below the camera
+    }
+    // sphere of radius 0.5 m at (0.3, 0.2, 2)
+    double b = dx*0.3 + dy*0.2 + 2.;
+    double a = dx*dx + dy*dy + 1.;
+    double c = 0.3*0.3 + 0.2*0.2 + 4. - 0.25;
+    double disc = b*b - a*c;
+    if(disc > 0.) {
+      depth = min(depth, (b - sqrt(disc))/a);
+    }
+    depth += 0.002*depth*depth*(uniform() - 0.5);
+    coords[3*i] = dx*depth;
+    coords[3*i+1] = dy*depth;
+    coords[3*i+2] = depth;
+  }
+}
+
+// the cloud after a small motion, as in the late iterations of AlignScan
+static void make_queries(vector<float> const &coords, vector<float> &queries) {
+  queries.resize(coords.size());
+  double a = 0.01, ca = cos(a), sa = sin(a);
+  for(size_t i = 0; i < coords.size(); i += 3) {
+    queries[i] = ca*coords[i] - sa*coords[i+2] + 0.01;
+    queries[i+1] = coords[i+1] + 0.005;
+    queries[i+2] = sa*coords[i] + ca*coords[i+2];
+  }
+}
+
+static int count_mismatches(vector<ANNdist> const &a, vector<float> const &b) {
+  int mismatches = 0;
+  for(size_t i = 0; i < a.size(); i++) {
+    if(fabs(a[i] - b[i]) > 1e-5*a[i] + 1e-12) {
+      mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+// searches the k nearest neighbours of all queries one after the other, returns the time
+static double search_ann(ANNpointSet &ann, vector<ANNcoord> &queries, int k, vector<ANNidx> &idx, vector<ANNdist> &dist) {
+  int m = queries.size()/3;
+  idx.resize(k*m);
+  dist.resize(k*m);
+  double t0 = now();
+  for(int i = 0; i < m; i++) {
+    ann.annkSearch(&queries[3*i], k, &idx[k*i], &dist[k*i], 0.0);
+  }
+  return now() - t0;
+}
+
+template <int K> static double search_tree(KDTree<3, float> const &tree, vector<float> const &queries, vector<int> &idx, vector<float> &dist) {
+  int m = queries.size()/3;
+  idx.resize(K*m);
+  dist.resize(K*m);
+  double t0 = now();
+  for(int i = 0; i < m; i++) {
+    tree.Search<K>(&queries[3*i], &idx[K*i], &dist[K*i]);
+  }
+  return now() - t0;
+}
+
+static void print_row(const char *name, double ann, double flat, double tree) {
+  cout << setw(16) << left << name << right << setw(12) << 1e3*ann;
+  if(flat >= 0.) {
+    cout << setw(12) << 1e3*flat;
+  }
+  else {
+    cout << setw(12) << "-";
+  }
+  cout << setw(12) << 1e3*tree << endl;
+}
+
+static void bench(int n) {
+  vector<float> coords, queries;
+  make_cloud(n, coords);
+  make_queries(coords, queries);
+  // ANN works on double coordinates, it gets a copy of the same points
+  vector<ANNcoord> ann_coords(coords.begin(), coords.end());
+  vector<ANNcoord> ann_queries_coords(queries.begin(), queries.end());
+  vector<ANNidx> ann_idx;
+  vector<ANNdist> ann_dist, flat_dist;
+  vector<int> idx;
+  vector<float> dist;
+  int mismatches = 0;
+  double t0, t_ann, t_flat, t_tree;
+
+  cout << n << " points, times in ms" << endl;
+  cout << setw(16) << "" << setw(12) << "ANN" << setw(12) << "ANN flat" << setw(12) << "KDTree" << endl;
+
+  // build (the flattened tree includes building the ANN tree)
+  vector<ANNpoint> ann_points(n);
+  for(int i = 0; i < n; i++) {
+    ann_points[i] = &ann_coords[3*i];
+  }
+  t0 = now();
+  ANNkd_tree ann(&ann_points[0], n, 3, 10);
+  t_ann = now() - t0;
+  t0 = now();
+  ANNkd_flat_tree flat(&ann_points[0], n, 3, 10);
+  t_flat = now() - t0;
+  t0 = now();
+  KDTree<3, float> tree(&coords[0], n, 10);
+  t_tree = now() - t0;
+  print_row("build", t_ann, t_flat, t_tree);
+
+  // k = 2 (AlignScan), one query after the other
+  t_ann = search_ann(ann, ann_queries_coords, 2, ann_idx, ann_dist);
+  t_flat = search_ann(flat, ann_queries_coords, 2, ann_idx, flat_dist);
+  t_tree = search_tree<2>(tree, queries, idx, dist);
+  mismatches += count_mismatches(ann_dist, dist) + count_mismatches(flat_dist, dist);
+  print_row("k=2", t_ann, t_flat, t_tree);
+
+  // k = 2, batched in Morton order
+  vector<ANNpoint> ann_queries(n);
+  for(int i = 0; i < n; i++) {
+    ann_queries[i] = &ann_queries_coords[3*i];
+  }
+  t0 = now();
+  ann.annkSearchBatch(&ann_queries[0], n, 2, &ann_idx[0], &ann_dist[0], 0.0, 1);
+  t_ann = now() - t0;
+  t0 = now();
+  vector<int> order(n);
+  tree.MortonOrder(&queries[0], n, &order[0]);
+  tree.SearchOrdered<2>(&queries[0], &order[0], 0, n, &idx[0], &dist[0]);
+  t_tree = now() - t0;
+  mismatches += count_mismatches(ann_dist, dist);
+  print_row("k=2 batched", t_ann, -1., t_tree);
+
+  // k = 20 (ComputeMatrices) for the points themselves
+  t_ann = search_ann(ann, ann_coords, 20, ann_idx, ann_dist);
+  t_flat = search_ann(flat, ann_coords, 20, ann_idx, flat_dist);
+  t_tree = search_tree<20>(tree, coords, idx, dist);
+  mismatches += count_mismatches(ann_dist, dist) + count_mismatches(flat_dist, dist);
+  print_row("k=20", t_ann, t_flat, t_tree);
+
+  cout << "distance mismatches: " << mismatches << endl << endl;
+}
+
+int main(int argc, char** argv) {
+  srand(1);
+  cout << fixed << setprecision(1);
+  if(argc > 1) {
+    for(int i = 1; i < argc; i++) {
+      bench(atoi(argv[i]));
+    }
+  }
+  else {
+    bench(20000);
+    bench(100000);
+    bench(300000);
+  }
+  return 0;
+}
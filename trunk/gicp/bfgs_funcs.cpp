@@ -70,14 +70,14 @@ namespace dgc {
 	int j = opt_data->nn_indecies[i];	
 	if(j != -1) {
 	  // get point 1
-	  pt1[0] = (*opt_data->p1)[i].x;
-	  pt1[1] = (*opt_data->p1)[i].y;
-	  pt1[2] = (*opt_data->p1)[i].z;
+	  pt1[0] = opt_data->p1->Point(i)[0];
+	  pt1[1] = opt_data->p1->Point(i)[1];
+	  pt1[2] = opt_data->p1->Point(i)[2];
 	  
 	  // get point 2
-	  pt2[0] = (*opt_data->p2)[j].x;
-	  pt2[1] = (*opt_data->p2)[j].y;
-	  pt2[2] = (*opt_data->p2)[j].z;
+	  pt2[0] = opt_data->p2->Point(j)[0];
+	  pt2[1] = opt_data->p2->Point(j)[1];
+	  pt2[2] = opt_data->p2->Point(j)[2];
 	  
 	  //get M-matrix
 	  gsl_M = gsl_matrix_view_array(&opt_data->M[i][0][0], 3, 3);
@@ -137,14 +137,14 @@ namespace dgc {
 	int j = opt_data->nn_indecies[i];	
 	if(j != -1) {
 	  // get point 1
-	  pt1[0] = (*opt_data->p1)[i].x;
-	  pt1[1] = (*opt_data->p1)[i].y;
-	  pt1[2] = (*opt_data->p1)[i].z;
+	  pt1[0] = opt_data->p1->Point(i)[0];
+	  pt1[1] = opt_data->p1->Point(i)[1];
+	  pt1[2] = opt_data->p1->Point(i)[2];
 	  
 	  // get point 2
-	  pt2[0] = (*opt_data->p2)[j].x;
-	  pt2[1] = (*opt_data->p2)[j].y;
-	  pt2[2] = (*opt_data->p2)[j].z;
+	  pt2[0] = opt_data->p2->Point(j)[0];
+	  pt2[1] = opt_data->p2->Point(j)[1];
+	  pt2[2] = opt_data->p2->Point(j)[2];
 	  
 	  //get M-matrix
 	  gsl_M = gsl_matrix_view_array(&opt_data->M[i][0][0], 3, 3);	  
@@ -167,9 +167,9 @@ namespace dgc {
 	  if(opt_data->solve_rotation) {
 	    // compute rotation gradient here
 	    // get back the original untransformed point to compute the rotation gradient
-	    pt1[0] = (*opt_data->p1)[i].x;
-	    pt1[1] = (*opt_data->p1)[i].y;
-	    pt1[2] = (*opt_data->p1)[i].z;
+	    pt1[0] = opt_data->p1->Point(i)[0];
+	    pt1[1] = opt_data->p1->Point(i)[1];
+	    pt1[2] = opt_data->p1->Point(i)[2];
 	    dgc_transform_point(&pt1[0], &pt1[1], &pt1[2], opt_data->base_t);
 	    gsl_blas_dger(2./(double)opt_data->num_matches, &gsl_pt1.vector, &gsl_temp.vector, &gsl_temp_mat_r.matrix);
 	  }
@@ -219,14 +219,14 @@ namespace dgc {
 	int j = opt_data->nn_indecies[i];	
 	if(j != -1) {
 	  // get point 1
-	  pt1[0] = (*opt_data->p1)[i].x;
-	  pt1[1] = (*opt_data->p1)[i].y;
-	  pt1[2] = (*opt_data->p1)[i].z;
+	  pt1[0] = opt_data->p1->Point(i)[0];
+	  pt1[1] = opt_data->p1->Point(i)[1];
+	  pt1[2] = opt_data->p1->Point(i)[2];
 	  
 	  // get point 2
-	  pt2[0] = (*opt_data->p2)[j].x;
-	  pt2[1] = (*opt_data->p2)[j].y;
-	  pt2[2] = (*opt_data->p2)[j].z;
+	  pt2[0] = opt_data->p2->Point(j)[0];
+	  pt2[1] = opt_data->p2->Point(j)[1];
+	  pt2[2] = opt_data->p2->Point(j)[2];
 	  
 	  //cout << "accessing " << i << " of " << opt_data->p1->Size() << ", " << opt_data->p2->Size() << endl;
 	  //get M-matrix
@@ -257,9 +257,9 @@ namespace dgc {
 	  if(opt_data->solve_rotation) {
 	    // accumulate the rotation gradient matrix
 	    // get back the original untransformed point to compute the rotation gradient
-	    pt1[0] = (*opt_data->p1)[i].x;
-	    pt1[1] = (*opt_data->p1)[i].y;
-	    pt1[2] = (*opt_data->p1)[i].z;
+	    pt1[0] = opt_data->p1->Point(i)[0];
+	    pt1[1] = opt_data->p1->Point(i)[1];
+	    pt1[2] = opt_data->p1->Point(i)[2];
 	    dgc_transform_point(&pt1[0], &pt1[1], &pt1[2], opt_data->base_t);
 	    // gsl_temp_mat_r += 2*(gsl_temp).(gsl_pt1)' [ = (2*M*residual).(gsl_pt1)' ]	  
 	    gsl_blas_dger(2./(double)opt_data->num_matches, &gsl_pt1.vector, &gsl_temp.vector, &gsl_temp_mat_r.matrix); 
@@ -43,6 +43,8 @@
 #include <iostream> //TODO: remove
 #include <sstream>
 #include <pthread.h>
+#include <unistd.h>
+#include <cmath>
 
 
 using namespace std;//TODO: remove
@@ -52,7 +54,6 @@ namespace gicp {
 
 GICPPointSet::GICPPointSet()
 {
-	kdtree_points_ = NULL;
 	kdtree_ = NULL;
 	max_iteration_ = 200; // default value
 	max_iteration_inner_ = 20; // default value for inner loop
@@ -63,8 +64,13 @@ GICPPointSet::GICPPointSet()
 	gicp_epsilon_ = .0004; // epsilon constant for gicp paper; this is NOT the convergence tolerence
 	debug_ = false;
 	solve_rotation_ = true;
+	use_lm_ = true;
 	matrices_done_ = false;
 	kdtree_done_ = false;
+	num_threads_ = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_threads_ < 1) {
+		num_threads_ = 1;
+	}
 	pthread_mutex_init(&mutex_, NULL);
 }
 
@@ -72,8 +78,6 @@ GICPPointSet::~GICPPointSet()
 {
 	if (kdtree_ != NULL)
 		delete kdtree_;
-	if (kdtree_points_ != NULL)
-		annDeallocPts(kdtree_points_);
 }
 
 void GICPPointSet::Clear(void) {
@@ -84,11 +88,9 @@ void GICPPointSet::Clear(void) {
 		delete kdtree_;
 		kdtree_ = NULL;
 	}
-	if (kdtree_points_ != NULL) {
-		annDeallocPts(kdtree_points_);
-		kdtree_points_ = NULL;
-	}
-	point_.clear();
+	coords_.clear();
+	range_.clear();
+	cov_.clear();
 	pthread_mutex_unlock(&mutex_);
 
 }
@@ -97,70 +99,172 @@ void GICPPointSet::BuildKDTree(void)
 {
 	pthread_mutex_lock(&mutex_);
 	if(kdtree_done_) {
+		pthread_mutex_unlock(&mutex_);
 		return;
 	}
 	kdtree_done_ = true;
 	pthread_mutex_unlock(&mutex_);
 
-	int i, n = NumPoints();
+	int n = NumPoints();
 
 	if(n == 0) {
 		return;
 	}
 
-	kdtree_points_ = annAllocPts(n, 3);
-	for(i = 0; i < n; i++) {
-		kdtree_points_[i][0] = point_[i].x;
-		kdtree_points_[i][1] = point_[i].y;
-		kdtree_points_[i][2] = point_[i].z;
+	// the tree refers to the coordinates of the point set
+	kdtree_ = new KDTree<3, float>(&coords_[0], n, 10);
+}
+
+/* Eigenvector of the smallest eigenvalue of the symmetric matrix a (closed form).
+   The eigenvalues are the roots of the characteristic polynomial (trigonometric 
+   solution), the eigenvector is taken from the null space of a - lambda*I. */
+static void smallest_eigenvector(gicp_mat_t a, double v[3])
+{
+	double p1 = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+	double q = (a[0][0] + a[1][1] + a[2][2])/3.;
+	double p2 = pow(a[0][0] - q, 2) + pow(a[1][1] - q, 2) + pow(a[2][2] - q, 2) + 2.*p1;
+	double p = sqrt(p2/6.);
+	double lambda = q;
+	if(p > 0.) {
+		gicp_mat_t b;
+		for(int k = 0; k < 3; k++) {
+			for(int l = 0; l < 3; l++) {
+				b[k][l] = (a[k][l] - ((k == l) ? q : 0.))/p;
+			}
+		}
+		double r = (b[0][0]*(b[1][1]*b[2][2] - b[1][2]*b[2][1])
+		          - b[0][1]*(b[1][0]*b[2][2] - b[1][2]*b[2][0])
+		          + b[0][2]*(b[1][0]*b[2][1] - b[1][1]*b[2][0]))/2.;
+		double phi = acos(r <= -1. ? -1. : (r >= 1. ? 1. : r))/3.;
+		lambda = q + 2.*p*cos(phi + 2.*M_PI/3.);
+	}
+
+	// the rows of a - lambda*I span the space orthogonal to v
+	double m[3][3];
+	double max_entry = 0.;
+	for(int k = 0; k < 3; k++) {
+		for(int l = 0; l < 3; l++) {
+			m[k][l] = a[k][l] - ((k == l) ? lambda : 0.);
+			max_entry = max(max_entry, fabs(m[k][l]));
+		}
+	}
+	double best = 0.;
+	for(int k = 0; k < 3; k++) {
+		double *r0 = m[k], *r1 = m[(k+1)%3];
+		double c[3] = { r0[1]*r1[2] - r0[2]*r1[1], r0[2]*r1[0] - r0[0]*r1[2], r0[0]*r1[1] - r0[1]*r1[0] };
+		double n = c[0]*c[0] + c[1]*c[1] + c[2]*c[2];
+		if(n > best) {
+			best = n;
+			v[0] = c[0]; v[1] = c[1]; v[2] = c[2];
+		}
+	}
+	if(best <= 1e-12*pow(max_entry, 4)) {
+		// smallest eigenvalue is (at least) double: any vector orthogonal to the largest row
+		int k_max = 0;
+		double n_max = 0.;
+		for(int k = 0; k < 3; k++) {
+			double n = m[k][0]*m[k][0] + m[k][1]*m[k][1] + m[k][2]*m[k][2];
+			if(n > n_max) {
+				n_max = n;
+				k_max = k;
+			}
+		}
+		if(n_max == 0.) { // isotropic
+			v[0] = 0.; v[1] = 0.; v[2] = 1.;
+			return;
+		}
+		double *r0 = m[k_max];
+		int axis = (fabs(r0[0]) <= fabs(r0[1]) && fabs(r0[0]) <= fabs(r0[2])) ? 0 : ((fabs(r0[1]) <= fabs(r0[2])) ? 1 : 2);
+		double e[3] = {0., 0., 0.};
+		e[axis] = 1.;
+		v[0] = r0[1]*e[2] - r0[2]*e[1];
+		v[1] = r0[2]*e[0] - r0[0]*e[2];
+		v[2] = r0[0]*e[1] - r0[1]*e[0];
+	}
+	double norm = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+	v[0] /= norm; v[1] /= norm; v[2] /= norm;
+}
+
+/* Split [0, n) into contiguous blocks and call fn(context, begin, end, block) for 
+   every block, each on its own pthread (the first block runs on the calling thread). */
+typedef void (*block_function_t)(void *context, int begin, int end, int block);
+
+struct BlockJob {
+	block_function_t fn;
+	void *context;
+	int begin, end, block;
+};
+
+static void *run_block(void *job)
+{
+	BlockJob *j = (BlockJob *)job;
+	j->fn(j->context, j->begin, j->end, j->block);
+	return NULL;
+}
+
+static void parallel_for(int n, int num_blocks, block_function_t fn, void *context)
+{
+	vector<pthread_t> threads(num_blocks);
+	vector<BlockJob> jobs(num_blocks);
+	for(int b = 0; b < num_blocks; b++) {
+		jobs[b].fn = fn;
+		jobs[b].context = context;
+		jobs[b].begin = (int)((long)n*b/num_blocks);
+		jobs[b].end = (int)((long)n*(b+1)/num_blocks);
+		jobs[b].block = b;
+	}
+	int started = 0;
+	for(int b = 1; b < num_blocks; b++) {
+		if(pthread_create(&threads[b], NULL, run_block, &jobs[b]) != 0) {
+			break;
+		}
+		started = b;
+	}
+	run_block(&jobs[0]);
+	for(int b = 1; b <= started; b++) {
+		pthread_join(threads[b], NULL);
 	}
-	kdtree_ = new ANNkd_tree(kdtree_points_, n, 3, 10);
+	// blocks whose thread could not be created
+	for(int b = started+1; b < num_blocks; b++) {
+		run_block(&jobs[b]);
+	}
+}
+
+void GICPPointSet::ComputeMatricesBlock(void *set, int begin, int end, int /*block*/)
+{
+	((GICPPointSet *)set)->ComputeMatricesRange(begin, end);
 }
 
 void GICPPointSet::ComputeMatrices() {
 	pthread_mutex_lock(&mutex_);
 	if(kdtree_ == NULL) {
+		pthread_mutex_unlock(&mutex_);
 		return;
 	}
 	if(matrices_done_) {
+		pthread_mutex_unlock(&mutex_);
 		return;
 	}
 	matrices_done_ = true;
 	pthread_mutex_unlock(&mutex_);
 
-	int N  = NumPoints();
-	int K = 20; // number of closest points to use for local covariance estimate
-	double mean[3];
+	int N = NumPoints();
+	int num_threads = min(num_threads_, max(1, N/1000)); // not worth it for small sets
 
-	ANNpoint query_point = annAllocPt(3);
+	/* kd-tree searches are re-entrant, all other buffers are allocated per block */
+	parallel_for(N, num_threads, ComputeMatricesBlock, this);
+}
 
-	ANNdist *nn_dist_sq = new ANNdist[K];
-	if(nn_dist_sq == NULL) {
-		//TODO: handle this
-	}      
-	ANNidx *nn_indecies = new ANNidx[K];
-	if(nn_indecies == NULL) {
-		//TODO: handle this
-	}
-	gsl_vector *work = gsl_vector_alloc(3);
-	if(work == NULL) {
-		//TODO: handle
-	}
-	gsl_vector *gsl_singulars = gsl_vector_alloc(3);
-	if(gsl_singulars == NULL) {
-		//TODO: handle
-	}
-	gsl_matrix *gsl_v_mat = gsl_matrix_alloc(3, 3);
-	if(gsl_v_mat == NULL) {
-		//TODO: handle
-	}
+void GICPPointSet::ComputeMatricesRange(int begin, int end) {
+	const int K = 20; // number of closest points to use for local covariance estimate
+	double mean[3];
+	gicp_mat_t cov;
+	double normal[3];
 
-	for(int i = 0; i < N; i++) {
-		query_point[0] = point_[i].x;
-		query_point[1] = point_[i].y;
-		query_point[2] = point_[i].z;
+	float nn_dist_sq[K];
+	int nn_indecies[K];
 
-		gicp_mat_t &cov = point_[i].C;
+	for(int i = begin; i < end; i++) {
 		// zero out the cov and mean
 		for(int k = 0; k < 3; k++) {
 			mean[k] = 0.;
@@ -169,81 +273,198 @@ void GICPPointSet::ComputeMatrices() {
 			}
 		}
 
-		kdtree_->annkSearch(query_point, K, nn_indecies, nn_dist_sq, 0.0);
+		int found = kdtree_->Search<K>(Point(i), nn_indecies, nn_dist_sq); // less than K for tiny sets
 
 		// find the covariance matrix
-		for(int j = 0; j < K; j++) {
-			GICPPoint &pt = point_[nn_indecies[j]];
+		for(int j = 0; j < found; j++) {
+			float const* pt = Point(nn_indecies[j]);
+			double x = pt[0], y = pt[1], z = pt[2];
 
-			mean[0] += pt.x;
-			mean[1] += pt.y;
-			mean[2] += pt.z;
+			mean[0] += x;
+			mean[1] += y;
+			mean[2] += z;
 
-			cov[0][0] += pt.x*pt.x;
+			cov[0][0] += x*x;
 
-			cov[1][0] += pt.y*pt.x;
-			cov[1][1] += pt.y*pt.y;
+			cov[1][0] += y*x;
+			cov[1][1] += y*y;
 
-			cov[2][0] += pt.z*pt.x;
-			cov[2][1] += pt.z*pt.y;
-			cov[2][2] += pt.z*pt.z;	  
+			cov[2][0] += z*x;
+			cov[2][1] += z*y;
+			cov[2][2] += z*z;	  
 		}
 
-		mean[0] /= (double)K;
-		mean[1] /= (double)K;
-		mean[2] /= (double)K;
+		mean[0] /= (double)found;
+		mean[1] /= (double)found;
+		mean[2] /= (double)found;
 		// get the actual covariance
 		for(int k = 0; k < 3; k++) {
 			for(int l = 0; l <= k; l++) {
-				cov[k][l] /= (double)K;
+				cov[k][l] /= (double)found;
 				cov[k][l] -= mean[k]*mean[l];
 				cov[l][k] = cov[k][l];
 			}
 		}
 
-		// compute the SVD
-		gsl_matrix_view gsl_cov = gsl_matrix_view_array(&cov[0][0], 3, 3);
-		gsl_linalg_SV_decomp(&gsl_cov.matrix, gsl_v_mat, gsl_singulars, work);
+		// The biggest 2 singular values are replaced by 1 and the smallest by gicp_epsilon.
+		// As the eigenvectors are orthonormal, this is I - (1 - gicp_epsilon)*n*n' with 
+		// the eigenvector n of the smallest eigenvalue (the surface normal)
+		smallest_eigenvector(cov, normal);
+		double s = 1. - gicp_epsilon_;
+		float *C = Cov(i);
+		C[0] = 1. - s*normal[0]*normal[0];
+		C[1] =    - s*normal[0]*normal[1];
+		C[2] =    - s*normal[0]*normal[2];
+		C[3] = 1. - s*normal[1]*normal[1];
+		C[4] =    - s*normal[1]*normal[2];
+		C[5] = 1. - s*normal[2]*normal[2];
+	}
+}
+
+/* Shared state of the correspondence search in one outer iteration of AlignScan */
+struct CorrespondenceContext {
+	GICPPointSet *target;
+	GICPPointSet *scan;
+	dgc_transform_t T; // base_t and t composed
+	double max_d_sq;
+	int *nn_indecies;
+	gicp_mat_t *mahalanobis;
+	vector<int> num_matches; // per block
+	char *needs_search;     // the point moved too far since its last search
+	/* the points searched in one batch */
+	vector<float> search_queries; // their transformed coordinates
+	vector<int> search_index;     // their indices in the scan
+	vector<int> search_order;     // order in which the queries are searched
+	vector<int> found_idx;        // two nearest neighbours per query
+	vector<float> found_dist_sq;
+	/* state of the incremental search, kept over the outer iterations */
+	float *last_query;      // transformed scan point at its last search
+	float *search_slack;    // half the gap between the two nearest neighbours at that search (-1: none yet)
+	int *nearest;           // nearest neighbour found at that search
+	int *mahalanobis_epoch; // rotation epoch in which mahalanobis[i] was computed
+	int epoch;              // incremented when the rotation changed noticeably
+};
+
+/* Invert the symmetric positive definite 3x3 matrix a (by its adjugate) */
+static inline void invert_symmetric(gicp_mat_t a, gicp_mat_t inv)
+{
+	double c00 = a[1][1]*a[2][2] - a[1][2]*a[1][2];
+	double c01 = a[0][2]*a[1][2] - a[0][1]*a[2][2];
+	double c02 = a[0][1]*a[1][2] - a[0][2]*a[1][1];
+	double c11 = a[0][0]*a[2][2] - a[0][2]*a[0][2];
+	double c12 = a[0][1]*a[0][2] - a[0][0]*a[1][2];
+	double c22 = a[0][0]*a[1][1] - a[0][1]*a[0][1];
+	double inv_det = 1./(a[0][0]*c00 + a[0][1]*c01 + a[0][2]*c02);
+	inv[0][0] = c00*inv_det; inv[0][1] = c01*inv_det; inv[0][2] = c02*inv_det;
+	inv[1][0] = inv[0][1];   inv[1][1] = c11*inv_det; inv[1][2] = c12*inv_det;
+	inv[2][0] = inv[0][2];   inv[2][1] = inv[1][2];   inv[2][2] = c22*inv_det;
+}
+
+/* A point keeps its nearest neighbour as long as it moved less than its search_slack
+   since the last search: the distance to the old neighbour grows by at most the motion
+   and the distance to any other point shrinks by at most the motion. The points that
+   moved further are marked here and searched afterwards in one batch. */
+void GICPPointSet::SelectSearchesBlock(void *context, int begin, int end, int /*block*/)
+{
+	CorrespondenceContext *c = (CorrespondenceContext *)context;
+	dgc_transform_t &T = c->T;
+	double q[3];
 
-		// zero out the cov matrix, since we know U = V since C is symmetric
+	for (int i = begin; i < end; i++) {
+		float const* p = c->scan->Point(i);
 		for(int k = 0; k < 3; k++) {
-			for(int l = 0; l < 3; l++) {
-				cov[k][l] = 0;
+			q[k] = T[k][0]*p[0] + T[k][1]*p[1] + T[k][2]*p[2] + T[k][3];
+		}
+
+		float *last = &c->last_query[3*i];
+		double moved_sq = (q[0]-last[0])*(q[0]-last[0]) + (q[1]-last[1])*(q[1]-last[1]) + (q[2]-last[2])*(q[2]-last[2]);
+		if (c->search_slack[i] >= 0 && moved_sq <= c->search_slack[i]*c->search_slack[i]) {
+			c->needs_search[i] = 0;
+		}
+		else {
+			for(int k = 0; k < 3; k++) {
+				last[k] = q[k];
 			}
+			c->needs_search[i] = 1;
 		}
+	}
+}
 
-		// reconstitute the covariance matrix with modified singular values using the column vectors in V.
+/* Search the two nearest neighbours of a range of the (sorted) queries */
+void GICPPointSet::SearchBlock(void *context, int begin, int end, int /*block*/)
+{
+	CorrespondenceContext *c = (CorrespondenceContext *)context;
+	c->target->kdtree_->SearchOrdered<2>(&c->search_queries[0], &c->search_order[0], begin, end,
+	                                     &c->found_idx[0], &c->found_dist_sq[0]);
+}
+
+/* Match every point to its current nearest neighbour and set up the Mahalanobis matrices.
+   A matrix is reused if the neighbour did not change since it was computed (a new
+   neighbour resets mahalanobis_epoch) and neither did the rotation epoch. */
+void GICPPointSet::FindCorrespondencesBlock(void *context, int begin, int end, int block)
+{
+	CorrespondenceContext *c = (CorrespondenceContext *)context;
+	GICPPointSet *target = c->target;
+	dgc_transform_t &T = c->T;
+	double q[3];
+	int num_matches = 0;
+
+	for (int i = begin; i < end; i++) {
+		float const* p = c->scan->Point(i);
 		for(int k = 0; k < 3; k++) {
-			gsl_vector_view col = gsl_matrix_column(gsl_v_mat, k);
+			q[k] = T[k][0]*p[0] + T[k][1]*p[1] + T[k][2]*p[2] + T[k][3];
+		}
 
-			double v = 1.; // biggest 2 singular values replaced by 1
-			if(k == 2) {   // smallest singular value replaced by gicp_epsilon
-				v = gicp_epsilon_;
-			}
+		int nn = c->nearest[i];
+		float const* pt = target->Point(nn);
+		double nn_dist_sq = (q[0]-pt[0])*(q[0]-pt[0]) + (q[1]-pt[1])*(q[1]-pt[1]) + (q[2]-pt[2])*(q[2]-pt[2]);
 
-			gsl_blas_dger(v, &col.vector, &col.vector, &gsl_cov.matrix); 
+		if (nn_dist_sq < c->max_d_sq) {
+			c->nn_indecies[i] = nn;
+			num_matches++;
+			if (c->mahalanobis_epoch[i] == c->epoch) {
+				continue; // still valid
+			}
+			// M = (C2 + R*C1*R')^-1, R being the rotation of T
+			gicp_mat_t C1, RC1, temp;
+			cov_to_mat(c->scan->Cov(i), C1);
+			float const* C2 = target->Cov(nn);
+			for(int k = 0; k < 3; k++) {
+				for(int l = 0; l < 3; l++) {
+					RC1[k][l] = T[k][0]*C1[0][l] + T[k][1]*C1[1][l] + T[k][2]*C1[2][l];
+				}
+			}
+			for(int k = 0; k < 3; k++) {
+				for(int l = k; l < 3; l++) {
+					temp[k][l] = RC1[k][0]*T[l][0] + RC1[k][1]*T[l][1] + RC1[k][2]*T[l][2];
+				}
+			}
+			temp[0][0] += C2[0]; temp[0][1] += C2[1]; temp[0][2] += C2[2];
+			temp[1][1] += C2[3]; temp[1][2] += C2[4]; temp[2][2] += C2[5];
+			temp[1][0] = temp[0][1]; temp[2][0] = temp[0][2]; temp[2][1] = temp[1][2];
+			invert_symmetric(temp, c->mahalanobis[i]);
+			c->mahalanobis_epoch[i] = c->epoch;
+		}
+		else {
+			c->nn_indecies[i] = -1; // no match
 		}
 	}
+	c->num_matches[block] = num_matches;
+}
 
-	if(nn_dist_sq != NULL) {
-		delete [] nn_dist_sq;
-	}
-	if(nn_indecies != NULL) {
-		delete [] nn_indecies;
-	}
-	if(work != NULL) {
-		gsl_vector_free(work);
-	}
-	if(gsl_v_mat != NULL) {
-		gsl_matrix_free(gsl_v_mat);
-	}
-	if(gsl_singulars != NULL) {
-		gsl_vector_free(gsl_singulars);
+/* Rotation angle between the rotational parts of two transforms */
+static double rotation_angle_between(dgc_transform_t a, dgc_transform_t b)
+{
+	double trace = 0.; // of Ra' * Rb
+	for(int k = 0; k < 3; k++) {
+		for(int l = 0; l < 3; l++) {
+			trace += a[l][k]*b[l][k];
+		}
 	}
-	query_point;
+	return acos(max(-1., min(1., (trace - 1.)/2.)));
 }
 
-int GICPPointSet::AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_transform_t t, double max_match_dist, bool save_error_plot)
+int GICPPointSet::AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_transform_t t, double max_match_dist, bool save_error_plot, double *rms_error, int *matches)
 {
 	double max_d_sq = pow(max_match_dist, 2);
 	int num_matches = 0;
@@ -251,9 +472,7 @@ int GICPPointSet::AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_tran
 	double delta = 0.;
 	dgc_transform_t t_last;
 	ofstream fout_corresp;
-	ANNdist nn_dist_sq;
-	ANNidx *nn_indecies = new ANNidx[n];
-	ANNpoint query_point = annAllocPt(3);
+	int *nn_indecies = new int[n];
 
 	if(nn_indecies == NULL) {
 		//TODO: fail here
@@ -263,14 +482,31 @@ int GICPPointSet::AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_tran
 	if(mahalanobis == NULL) {
 		//TODO: fail here
 	}
-	gsl_matrix *gsl_R = gsl_matrix_alloc(3, 3);
-	if(gsl_R == NULL) {
-		//TODO: fail here
-	}
-	gsl_matrix *gsl_temp = gsl_matrix_alloc(3, 3);
-	if(gsl_temp == NULL) {
-		//TODO: fail here
+	CorrespondenceContext corr;
+	corr.target = this;
+	corr.scan = scan;
+	corr.max_d_sq = max_d_sq;
+	corr.nn_indecies = nn_indecies;
+	corr.mahalanobis = mahalanobis;
+	int num_blocks = min(num_threads_, max(1, n/1000)); // not worth it for small scans
+	corr.num_matches.resize(num_blocks);
+	corr.needs_search = new char[n];
+	corr.last_query = new float[3*n];
+	corr.search_slack = new float[n];
+	corr.nearest = new int[n];
+	corr.mahalanobis_epoch = new int[n];
+	for(int i = 0; i < n; i++) {
+		corr.search_slack[i] = -1.;
+		corr.last_query[3*i] = corr.last_query[3*i+1] = corr.last_query[3*i+2] = 0.;
+		corr.nearest[i] = -1;
+		corr.mahalanobis_epoch[i] = -1;
 	}
+	corr.epoch = -1;
+	corr.search_queries.reserve(3*n);
+	corr.search_index.reserve(n);
+	// the Mahalanobis matrices are recomputed after the rotation changed by more than this (in rad)
+	const double max_mahalanobis_rotation = 1e-3;
+	dgc_transform_t T_epoch;
 
 	bool converged = false;
 	int iteration = 0;
@@ -305,65 +541,60 @@ int GICPPointSet::AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_tran
 	}
 
 	while(!converged) {
-		dgc_transform_t transform_R;
-		dgc_transform_copy(transform_R, base_t);
-		dgc_transform_left_multiply(transform_R, t);
-		// copy the rotation component of the current total transformation (including base), into a gsl matrix
-		for(int i = 0; i < 3; i++) {
-			for(int j = 0; j < 3; j++) {
-				gsl_matrix_set(gsl_R, i, j, transform_R[i][j]);
+		// the total transformation (including base), composed once for all points
+		dgc_transform_copy(corr.T, base_t);
+		dgc_transform_left_multiply(corr.T, t);
+		if(corr.epoch < 0 || rotation_angle_between(corr.T, T_epoch) > max_mahalanobis_rotation) {
+			corr.epoch++;
+			dgc_transform_copy(T_epoch, corr.T);
+		}
+
+		/* find correpondences and set up the mahalanobis matrices, in parallel.
+		   Late iterations only search for the points that moved considerably.
+		   These are searched in one batch, sorted for locality in the tree */
+		parallel_for(n, num_blocks, SelectSearchesBlock, &corr);
+		corr.search_queries.clear();
+		corr.search_index.clear();
+		for(int i = 0; i < n; i++) {
+			if(corr.needs_search[i]) {
+				corr.search_queries.insert(corr.search_queries.end(), &corr.last_query[3*i], &corr.last_query[3*i+3]);
+				corr.search_index.push_back(i);
 			}
 		}
-		if(debug_) {
-			fout_corresp.open("correspondence.txt");
+		int num_searches = corr.search_index.size();
+		if(num_searches > 0) {
+			corr.search_order.resize(num_searches);
+			corr.found_idx.resize(2*num_searches);
+			corr.found_dist_sq.resize(2*num_searches);
+			kdtree_->MortonOrder(&corr.search_queries[0], num_searches, &corr.search_order[0]);
+			int search_blocks = min(num_threads_, max(1, num_searches/1000));
+			parallel_for(num_searches, search_blocks, SearchBlock, &corr);
+		}
+		for(int j = 0; j < num_searches; j++) {
+			int i = corr.search_index[j];
+			int *idx = &corr.found_idx[2*j];
+			float *dist_sq = &corr.found_dist_sq[2*j];
+			if(idx[0] != corr.nearest[i]) {
+				corr.nearest[i] = idx[0];
+				corr.mahalanobis_epoch[i] = -1; // computed for another neighbour
+			}
+			corr.search_slack[i] = (idx[1] >= 0) ? 0.5*(sqrt(dist_sq[1]) - sqrt(dist_sq[0])) : 0.;
 		}
-		/* find correpondences */
+		parallel_for(n, num_blocks, FindCorrespondencesBlock, &corr);
 		num_matches = 0;
-		for (int i = 0; i < n; i++) {
-			query_point[0] = scan->point_[i].x;
-			query_point[1] = scan->point_[i].y;
-			query_point[2] = scan->point_[i].z;
-
-			dgc_transform_point(&query_point[0], &query_point[1], 
-					&query_point[2], base_t);
-			dgc_transform_point(&query_point[0], &query_point[1], 
-					&query_point[2], t);
-
-			kdtree_->annkSearch(query_point, 1, &nn_indecies[i], &nn_dist_sq, 0.0);
+		for(int b = 0; b < num_blocks; b++) {
+			num_matches += corr.num_matches[b];
+		}
+		if(debug_) {
+			cout << "Iteration " << iteration << ": " << num_searches << " of " << n << " points searched" << endl;
+		}
 
-			if (nn_dist_sq < max_d_sq) {
-				if(debug_) {
+		if(debug_) {
+			fout_corresp.open("correspondence.txt");
+			for(int i = 0; i < n; i++) {
+				if(nn_indecies[i] >= 0) {
 					fout_corresp << i << "\t" << nn_indecies[i] << endl;
 				}
-
-				// set up the updated mahalanobis matrix here
-				gsl_matrix_view C1 = gsl_matrix_view_array(&scan->point_[i].C[0][0], 3, 3);
-				gsl_matrix_view C2 = gsl_matrix_view_array(&point_[nn_indecies[i]].C[0][0], 3, 3);
-				gsl_matrix_view M = gsl_matrix_view_array(&mahalanobis[i][0][0], 3, 3);
-				gsl_matrix_set_zero(&M.matrix);	    
-				gsl_matrix_set_zero(gsl_temp);
-
-				// M = R*C1  // using M as a temp variable here
-				gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, 1., gsl_R, &C1.matrix, 1., &M.matrix);
-
-				// temp = M*R' // move the temp value to 'temp' here
-				gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1., &M.matrix, gsl_R, 0., gsl_temp);
-
-				// temp += C2
-				gsl_matrix_add(gsl_temp, &C2.matrix);
-				// at this point temp = C2 + R*C1*R'
-
-				// now invert temp to get the mahalanobis distance metric for gicp
-				// M = temp^-1
-				gsl_matrix_set_identity(&M.matrix); 
-				gsl_linalg_cholesky_decomp(gsl_temp);
-				for(int k = 0; k < 3; k++) {
-					gsl_linalg_cholesky_svx(gsl_temp, &gsl_matrix_row(&M.matrix, k).vector);
-				}
-				num_matches++;
-			}
-			else {
-				nn_indecies[i] = -1; // no match
 			}
 		}
 
@@ -389,7 +620,12 @@ int GICPPointSet::AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_tran
 
 		/* optimize transformation using the current assignment and Mahalanobis metrics*/
 		dgc_transform_copy(t_last, t);
-		opt_status = opt.Optimize(t, opt_data);
+		if(use_lm_) {
+			opt_status = opt.OptimizeLM(t, opt_data);
+		}
+		else {
+			opt_status = opt.Optimize(t, opt_data);
+		}
 
 		if(debug_) {
 			cout << "Optimizer converged in " << opt.Iterations() << " iterations." << endl;
@@ -434,19 +670,40 @@ int GICPPointSet::AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_tran
 			opt.PlotError(t, opt_data, "error_func");
 		}
 	}
+	/* residual of the last correspondences under the final transformation */
+	if(rms_error != NULL) {
+		dgc_transform_t T;
+		dgc_transform_copy(T, base_t);
+		dgc_transform_left_multiply(T, t);
+		double sum_sq = 0.;
+		for(int i = 0; i < n; i++) {
+			if(nn_indecies[i] < 0) {
+				continue;
+			}
+			float const* p = scan->Point(i);
+			float const* pt = Point(nn_indecies[i]);
+			double dx = T[0][0]*p[0] + T[0][1]*p[1] + T[0][2]*p[2] + T[0][3] - pt[0];
+			double dy = T[1][0]*p[0] + T[1][1]*p[1] + T[1][2]*p[2] + T[1][3] - pt[1];
+			double dz = T[2][0]*p[0] + T[2][1]*p[1] + T[2][2]*p[2] + T[2][3] - pt[2];
+			sum_sq += dx*dx + dy*dy + dz*dz;
+		}
+		*rms_error = (num_matches > 0) ? sqrt(sum_sq/num_matches) : 0.;
+	}
+	if(matches != NULL) {
+		*matches = num_matches;
+	}
+
 	if(nn_indecies != NULL) {
 		delete [] nn_indecies;
 	}
 	if(mahalanobis != NULL) {
 		delete [] mahalanobis;
 	}
-	if(gsl_R != NULL) {
-		gsl_matrix_free(gsl_R);
-	}
-	if(gsl_temp != NULL) {
-		gsl_matrix_free(gsl_temp);
-	}
-	annDeallocPt(query_point);
+	delete [] corr.needs_search;
+	delete [] corr.last_query;
+	delete [] corr.search_slack;
+	delete [] corr.nearest;
+	delete [] corr.mahalanobis_epoch;
 
 	return iteration;
 }
@@ -456,7 +713,8 @@ void GICPPointSet::SavePoints(const char *filename) {
 	if(out) {
 		int n = NumPoints();
 		for(int i = 0; i < n; i++) {
-			out << point_[i].x << "\t" << point_[i].y << "\t" << point_[i].z << endl;
+			float const* p = Point(i);
+			out << p[0] << "\t" << p[1] << "\t" << p[2] << endl;
 		}
 	}
 	out.close();
@@ -468,9 +726,11 @@ void GICPPointSet::SaveMatrices(const char *filename) {
 	if(out) {
 		int n = NumPoints();
 		for(int i = 0; i < n; i++) {
+			gicp_mat_t C;
+			cov_to_mat(Cov(i), C);
 			for(int k = 0; k < 3; k++) {
 				for(int l = 0; l < 3; l++) {
-					out << point_[i].C[k][l] << "\t";
+					out << C[k][l] << "\t";
 				}
 			}
 			out << endl;
@@ -39,21 +39,33 @@
 #ifndef GICP_H_
 #define GICP_H_
 
-#include <ANN/ANN.h>
 #include <vector>
 #include <iostream>
 //#include <gsl/gsl.h>
 #include <semaphore.h>
 #include "transform.h"
+#include "kdtree.h"
 
 namespace dgc {
   namespace gicp {
     typedef double gicp_mat_t[3][3];
+    typedef float gicp_cov_t[6]; // symmetric 3x3 matrix, stored as xx, xy, xz, yy, yz, zz
     
+    inline void cov_set_identity(gicp_cov_t c) {
+      c[0] = c[3] = c[5] = 1.f;
+      c[1] = c[2] = c[4] = 0.f;
+    }
+    inline void cov_to_mat(gicp_cov_t const c, gicp_mat_t m) {
+      m[0][0] = c[0]; m[0][1] = c[1]; m[0][2] = c[2];
+      m[1][0] = c[1]; m[1][1] = c[3]; m[1][2] = c[4];
+      m[2][0] = c[2]; m[2][1] = c[4]; m[2][2] = c[5];
+    }
+
+    // a single point as passed to GICPPointSet::AppendPoint
     struct GICPPoint {
-      double x, y, z;
+      float x, y, z;
       float range;
-      gicp_mat_t C; // covariance matrix
+      gicp_cov_t C; // covariance matrix
     };
     
     class GICPPointSet {
@@ -66,28 +78,55 @@ namespace dgc {
       void SavePoints(const char *filename);
       void SaveMatrices(const char *filename);
       
-      int NumPoints() { return (int)point_.size(); }
+      int NumPoints() const { return (int)range_.size(); }
       void Clear(void);
-      int Size() { return point_.size(); }
-      inline void AppendPoint(GICPPoint const & pt) { point_.push_back(pt); }
+      int Size() const { return (int)range_.size(); }
+      // points can not be added after BuildKDTree, as the tree uses their coordinates
+      inline void AppendPoint(GICPPoint const & pt) {
+        coords_.push_back(pt.x);
+        coords_.push_back(pt.y);
+        coords_.push_back(pt.z);
+        range_.push_back(pt.range);
+        cov_.insert(cov_.end(), pt.C, pt.C + 6);
+      }
       void SetMaxIteration(int iter) { max_iteration_ = iter; }
       void SetMaxIterationInner(int iter) { max_iteration_inner_ = iter; }
       void SetEpsilon(double eps) { epsilon_ = eps; }
       void SetSolveRotation(bool s) { solve_rotation_ = s; }
+      // Levenberg-Marquardt (default) or BFGS for the inner optimization
+      void SetUseLM(bool lm) { use_lm_ = lm; }
       void SetGICPEpsilon(double eps) { gicp_epsilon_ = eps; }
       void SetDebug(bool d) { debug_ = d; }
+      void SetNumThreads(int n) { num_threads_ = (n > 0) ? n : 1; }
+      // the covariances were set with the points, ComputeMatrices will not overwrite them
+      void SetMatricesDone(bool done) { matrices_done_ = done; }
 
 
-      GICPPoint & operator[](int i) { return point_[i]; }
-      GICPPoint const& operator[](int i) const { return point_[i]; }
+      // coordinates (x, y, z) of point i
+      float * Point(int i) { return &coords_[3*i]; }
+      float const* Point(int i) const { return &coords_[3*i]; }
+      // covariance of point i, see gicp_cov_t
+      float * Cov(int i) { return &cov_[6*i]; }
+      float const* Cov(int i) const { return &cov_[6*i]; }
+      float Range(int i) const { return range_[i]; }
       
       // returns number of iterations it took to converge
-      int AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_transform_t t, double max_match_dist, bool save_error_plot = 0);
+      // optionally reports the rms distance of the final correspondences (rms_error) and their number (matches)
+      int AlignScan(GICPPointSet *scan, dgc_transform_t base_t, dgc_transform_t t, double max_match_dist, bool save_error_plot = 0,
+                    double *rms_error = NULL, int *matches = NULL);
 
     private:
-      std::vector <GICPPoint> point_;
-      ANNpointArray kdtree_points_;
-      ANNkd_tree *kdtree_;
+      void ComputeMatricesRange(int begin, int end);
+      static void ComputeMatricesBlock(void *set, int begin, int end, int block);
+      static void SelectSearchesBlock(void *context, int begin, int end, int block);
+      static void SearchBlock(void *context, int begin, int end, int block);
+      static void FindCorrespondencesBlock(void *context, int begin, int end, int block);
+
+      // structure of arrays: 40 bytes per point, coordinates not duplicated for the kd-tree
+      std::vector <float> coords_; // x, y, z of each point
+      std::vector <float> range_;
+      std::vector <float> cov_;    // 6 entries per point
+      KDTree<3, float> *kdtree_; // on coords_
       int max_iteration_;
       int max_iteration_inner_;
       double epsilon_;
@@ -95,8 +134,10 @@ namespace dgc {
       double gicp_epsilon_;
       bool debug_;
       bool solve_rotation_;
+      bool use_lm_;
       bool matrices_done_;
       bool kdtree_done_;
+      int num_threads_;
       pthread_mutex_t mutex_;
     };
     
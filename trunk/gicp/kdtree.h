@@ -0,0 +1,348 @@
+/*************************************************************
+  Generalized-ICP Copyright (c) 2009 Aleksandr Segal.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with
+  or without modification, are permitted provided that the
+  following conditions are met:
+
+* Redistributions of source code must retain the above
+  copyright notice, this list of conditions and the
+  following disclaimer.
+* Redistributions in binary form must reproduce the above
+  copyright notice, this list of conditions and the
+  following disclaimer in the documentation and/or other
+  materials provided with the distribution.
+* The names of the contributors may not be used to endorse
+  or promote products derived from this software
+  without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+  PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+  DAMAGE.
+*************************************************************/
+
+
+
+#ifndef GICP_KDTREE_H_
+#define GICP_KDTREE_H_
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <limits>
+
+namespace dgc {
+  namespace gicp {
+    // Squared distance of two points with Dim coordinates, unrolled at compile time
+    template <int Dim, typename Scalar> struct KDSquaredDistance {
+      static inline Scalar Compute(const Scalar *a, const Scalar *b) {
+        Scalar t = a[Dim-1] - b[Dim-1];
+        return KDSquaredDistance<Dim-1, Scalar>::Compute(a, b) + t*t;
+      }
+    };
+    template <typename Scalar> struct KDSquaredDistance<1, Scalar> {
+      static inline Scalar Compute(const Scalar *a, const Scalar *b) {
+        Scalar t = a[0] - b[0];
+        return t*t;
+      }
+    };
+
+    // The K closest points found so far by a search, sorted by distance. Fixed size,
+    // so it lives on the stack of the search. Points are only accepted if they are
+    // closer than bound (a known upper bound on the K-th distance, if any).
+    template <int Dim, int K, typename Scalar> struct KDSearchResult {
+      int idx[K];
+      Scalar dist_sq[K];
+      int count;
+      Scalar bound;
+
+      explicit KDSearchResult(Scalar b) : count(0), bound(b) {}
+      // the distance a point has to beat to be accepted
+      inline Scalar Worst() const { return (count < K) ? bound : dist_sq[K-1]; }
+      inline void Insert(Scalar d, int i) {
+        int j = (count < K) ? count++ : K-1;
+        for(; j > 0 && dist_sq[j-1] > d; j--) {
+          dist_sq[j] = dist_sq[j-1];
+          idx[j] = idx[j-1];
+        }
+        dist_sq[j] = d;
+        idx[j] = i;
+      }
+    };
+
+    // A kd-tree for a fixed dimension, specialized for the searches of GICP: exact k nearest
+    // neighbours (k fixed at compile time) of 3-D points. Compared to ANN there is no runtime
+    // dimension, no virtual dispatch and no heap allocation during a search. The nodes are
+    // stored in one array in depth-first order (the lower child follows its parent) and are
+    // split by the sliding midpoint rule. The points are not copied, they must not change
+    // during the lifetime of the tree.
+    template <int Dim, typename Scalar> class KDTree {
+    public:
+      // points holds the Dim coordinates of each of the n points consecutively
+      KDTree(const Scalar *points, int n, int bucket_size = 10);
+
+      int NumPoints() const { return (int)index_.size(); }
+      const Scalar *Point(int i) const { return points_ + Dim*i; }
+
+      // The K nearest neighbours of q, sorted by distance. Returns how many were found
+      // (less than K only for small trees), the missing entries are set to -1 and the
+      // largest Scalar.
+      template <int K> int Search(const Scalar *q, int *idx, Scalar *dist_sq) const {
+        return SearchBounded<K>(q, idx, dist_sq, std::numeric_limits<Scalar>::max());
+      }
+      // As Search, but only points closer than bound are considered (bound must exceed the
+      // K-th distance to find all K neighbours)
+      template <int K> int SearchBounded(const Scalar *q, int *idx, Scalar *dist_sq, Scalar bound) const;
+
+      // Batched search: MortonOrder sorts the m queries (Dim coordinates each) by the Morton
+      // (Z-order) code of their position in the tree's bounding box. SearchOrdered then searches
+      // order[begin..end) in this order, such that consecutive searches visit the same nodes
+      // and each one starts with the distance bound given by the previous query's neighbours.
+      // The neighbours of query i are stored at idx[i*K..i*K+K). Disjoint ranges of the order
+      // can be searched in parallel.
+      void MortonOrder(const Scalar *queries, int m, int *order) const;
+      template <int K> void SearchOrdered(const Scalar *queries, const int *order, int begin, int end,
+                                          int *idx, Scalar *dist_sq) const;
+
+    private:
+      struct Node {
+        int cut_dim;    // splitting dimension, -1 for leaves
+        Scalar cut;     // splitting value
+        int hi;         // index of the upper child (the lower child is the next node)
+        int begin, end; // leaves: their points are index_[begin..end)
+      };
+
+      int Build(int begin, int end, Scalar *lo, Scalar *hi);
+      template <int K> void SearchNode(int node, const Scalar *q, Scalar box_dist, Scalar *offset,
+                                       KDSearchResult<Dim, K, Scalar> &result) const;
+
+      const Scalar *points_;
+      int bucket_size_;
+      std::vector<int> index_; // point indices, each leaf owns a contiguous range
+      std::vector<Node> nodes_;
+      Scalar bnd_lo_[Dim], bnd_hi_[Dim]; // bounding box of the points
+    };
+
+    template <int Dim, typename Scalar>
+    KDTree<Dim, Scalar>::KDTree(const Scalar *points, int n, int bucket_size) :
+      points_(points), bucket_size_((bucket_size > 0) ? bucket_size : 1), index_(n)
+    {
+      for(int d = 0; d < Dim; d++) {
+        bnd_lo_[d] = bnd_hi_[d] = (n > 0) ? points[d] : 0;
+      }
+      for(int i = 0; i < n; i++) {
+        index_[i] = i;
+        for(int d = 0; d < Dim; d++) {
+          bnd_lo_[d] = std::min(bnd_lo_[d], points[Dim*i + d]);
+          bnd_hi_[d] = std::max(bnd_hi_[d], points[Dim*i + d]);
+        }
+      }
+      nodes_.reserve(2*(n/bucket_size_) + 1);
+      Scalar lo[Dim], hi[Dim];
+      std::copy(bnd_lo_, bnd_lo_ + Dim, lo);
+      std::copy(bnd_hi_, bnd_hi_ + Dim, hi);
+      Build(0, n, lo, hi);
+    }
+
+    // Sliding midpoint split (as ANN_KD_SL_MIDPT): cut the longest side of the cell in the middle,
+    // among the nearly longest sides the one with the largest spread of the points. If all points
+    // are on one side, the cut slides to the closest point, so no child is empty.
+    template <int Dim, typename Scalar>
+    int KDTree<Dim, Scalar>::Build(int begin, int end, Scalar *lo, Scalar *hi)
+    {
+      int node = nodes_.size();
+      nodes_.push_back(Node());
+      nodes_[node].cut_dim = -1;
+      nodes_[node].begin = begin;
+      nodes_[node].end = end;
+      if(end - begin <= bucket_size_) {
+        return node;
+      }
+
+      Scalar max_length = 0;
+      for(int d = 0; d < Dim; d++) {
+        max_length = std::max(max_length, hi[d] - lo[d]);
+      }
+      Scalar min_val[Dim], max_val[Dim];
+      for(int d = 0; d < Dim; d++) {
+        min_val[d] = max_val[d] = points_[Dim*index_[begin] + d];
+      }
+      for(int j = begin+1; j < end; j++) {
+        const Scalar *p = points_ + Dim*index_[j];
+        for(int d = 0; d < Dim; d++) {
+          min_val[d] = std::min(min_val[d], p[d]);
+          max_val[d] = std::max(max_val[d], p[d]);
+        }
+      }
+      // the points may have collapsed along the long sides, then the largest spread is used
+      int cut_dim = -1, widest = 0;
+      for(int d = 0; d < Dim; d++) {
+        Scalar spread = max_val[d] - min_val[d];
+        if(hi[d] - lo[d] >= (Scalar)0.999*max_length && spread > 0 &&
+           (cut_dim < 0 || spread > max_val[cut_dim] - min_val[cut_dim])) {
+          cut_dim = d;
+        }
+        if(spread > max_val[widest] - min_val[widest]) {
+          widest = d;
+        }
+      }
+      if(cut_dim < 0) {
+        if(max_val[widest] <= min_val[widest]) { // all points coincide
+          return node;
+        }
+        cut_dim = widest;
+      }
+
+      Scalar cut = std::min(std::max((lo[cut_dim] + hi[cut_dim])/2, min_val[cut_dim]), max_val[cut_dim]);
+      // points below the cut go to the lower child, if the cut slid onto the smallest point
+      // this one goes there too
+      int *first = &index_[0] + begin, *last = &index_[0] + end, *middle = first;
+      for(int *j = first; j < last; j++) {
+        Scalar v = points_[Dim*(*j) + cut_dim];
+        if(v < cut || (cut == min_val[cut_dim] && v == cut)) {
+          std::swap(*j, *middle);
+          middle++;
+        }
+      }
+      int mid = begin + (middle - first);
+
+      nodes_[node].cut_dim = cut_dim;
+      nodes_[node].cut = cut;
+      Scalar saved = hi[cut_dim];
+      hi[cut_dim] = cut;
+      Build(begin, mid, lo, hi);
+      hi[cut_dim] = saved;
+      saved = lo[cut_dim];
+      lo[cut_dim] = cut;
+      int upper = Build(mid, end, lo, hi);
+      lo[cut_dim] = saved;
+      nodes_[node].hi = upper;
+      return node;
+    }
+
+    template <int Dim, typename Scalar> template <int K>
+    int KDTree<Dim, Scalar>::SearchBounded(const Scalar *q, int *idx, Scalar *dist_sq, Scalar bound) const
+    {
+      KDSearchResult<Dim, K, Scalar> result(bound);
+      if(!nodes_.empty()) {
+        // distance to the bounding box, per dimension and squared in total
+        Scalar offset[Dim];
+        Scalar box_dist = 0;
+        for(int d = 0; d < Dim; d++) {
+          offset[d] = std::max(std::max(bnd_lo_[d] - q[d], q[d] - bnd_hi_[d]), (Scalar)0);
+          box_dist += offset[d]*offset[d];
+        }
+        SearchNode<K>(0, q, box_dist, offset, result);
+      }
+      for(int k = 0; k < K; k++) {
+        idx[k] = (k < result.count) ? result.idx[k] : -1;
+        dist_sq[k] = (k < result.count) ? result.dist_sq[k] : std::numeric_limits<Scalar>::max();
+      }
+      return result.count;
+    }
+
+    // The closer child is searched first, the other one only if its cell is closer than the
+    // current K-th distance. offset holds the distance from q to the cell in each dimension,
+    // only the one of the cutting dimension changes from a cell to its children.
+    template <int Dim, typename Scalar> template <int K>
+    void KDTree<Dim, Scalar>::SearchNode(int node, const Scalar *q, Scalar box_dist, Scalar *offset,
+                                         KDSearchResult<Dim, K, Scalar> &result) const
+    {
+      const Node &nd = nodes_[node];
+      if(nd.cut_dim < 0) {
+        for(int j = nd.begin; j < nd.end; j++) {
+          int i = index_[j];
+          Scalar d = KDSquaredDistance<Dim, Scalar>::Compute(q, points_ + Dim*i);
+          if(d < result.Worst()) {
+            result.Insert(d, i);
+          }
+        }
+        return;
+      }
+
+      int cd = nd.cut_dim;
+      Scalar diff = q[cd] - nd.cut;
+      int near_child = (diff < 0) ? node+1 : nd.hi;
+      int far_child = (diff < 0) ? nd.hi : node+1;
+      SearchNode<K>(near_child, q, box_dist, offset, result);
+
+      Scalar old_offset = offset[cd];
+      Scalar far_dist = box_dist - old_offset*old_offset + diff*diff;
+      if(far_dist < result.Worst()) {
+        offset[cd] = diff;
+        SearchNode<K>(far_child, q, far_dist, offset, result);
+        offset[cd] = old_offset;
+      }
+    }
+
+    template <int Dim, typename Scalar>
+    void KDTree<Dim, Scalar>::MortonOrder(const Scalar *queries, int m, int *order) const
+    {
+      typedef unsigned long long morton_t;
+      const int nd = (Dim < 3) ? Dim : 3;   // coordinates used for the code
+      const int bits = std::min(63/nd, 32); // bits per coordinate
+      const double max_cell = (double)((1ULL << bits) - 1);
+
+      std::vector< std::pair<morton_t, int> > codes(m);
+      for(int i = 0; i < m; i++) {
+        morton_t cell[3];
+        for(int d = 0; d < nd; d++) {
+          double len = bnd_hi_[d] - bnd_lo_[d];
+          double x = (len > 0) ? (queries[Dim*i + d] - bnd_lo_[d])/len : 0.;
+          cell[d] = (morton_t)(std::min(std::max(x, 0.), 1.)*max_cell);
+        }
+        morton_t code = 0; // interleave the bits
+        for(int b = bits-1; b >= 0; b--) {
+          for(int d = 0; d < nd; d++) {
+            code = (code << 1) | ((cell[d] >> b) & 1);
+          }
+        }
+        codes[i].first = code;
+        codes[i].second = i;
+      }
+      std::sort(codes.begin(), codes.end());
+      for(int i = 0; i < m; i++) {
+        order[i] = codes[i].second;
+      }
+    }
+
+    // The largest distance from a query to the neighbours of the previous one bounds its K-th
+    // distance; slightly loosened, since a neighbour at exactly that distance is still accepted
+    template <int Dim, typename Scalar> template <int K>
+    void KDTree<Dim, Scalar>::SearchOrdered(const Scalar *queries, const int *order, int begin, int end,
+                                            int *idx, Scalar *dist_sq) const
+    {
+      for(int pos = begin; pos < end; pos++) {
+        int i = order[pos];
+        const Scalar *q = queries + Dim*i;
+        Scalar bound = std::numeric_limits<Scalar>::max();
+        if(pos > begin) {
+          const int *prev = idx + K*order[pos-1];
+          Scalar worst = 0;
+          for(int k = 0; k < K && worst < bound; k++) {
+            worst = (prev[k] < 0) ? bound : std::max(worst, KDSquaredDistance<Dim, Scalar>::Compute(q, Point(prev[k])));
+          }
+          if(worst < bound && worst > 0) {
+            bound = worst*(Scalar)(1. + 1e-5);
+          }
+        }
+        SearchBounded<K>(q, idx + K*i, dist_sq + K*i, bound);
+      }
+    }
+  }
+}
+
+#endif
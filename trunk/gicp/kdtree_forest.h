@@ -0,0 +1,237 @@
+/*************************************************************
+  Generalized-ICP Copyright (c) 2009 Aleksandr Segal.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with
+  or without modification, are permitted provided that the
+  following conditions are met:
+
+* Redistributions of source code must retain the above
+  copyright notice, this list of conditions and the
+  following disclaimer.
+* Redistributions in binary form must reproduce the above
+  copyright notice, this list of conditions and the
+  following disclaimer in the documentation and/or other
+  materials provided with the distribution.
+* The names of the contributors may not be used to endorse
+  or promote products derived from this software
+  without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+  PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+  DAMAGE.
+*************************************************************/
+
+
+
+#ifndef GICP_KDTREE_FOREST_H_
+#define GICP_KDTREE_FOREST_H_
+
+#include "kdtree.h"
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+namespace dgc {
+  namespace gicp {
+    // A growing point set with nearest neighbour search, made of static kd-trees (the
+    // logarithmic method): points are added as whole clouds, each identified by an id.
+    // A new cloud gets its own tree, which is merged with the next larger one as long as
+    // that one is at most twice as large. Thus the trees at least double in size from the
+    // newest to the oldest, there are O(log n) of them, and every point takes part in
+    // O(log n) rebuilds in total. Removing clouds rebuilds the trees that contained them;
+    // the most recent cloud is usually in one of the small trees, which makes undoing the
+    // last insertion cheap. Moving clouds (e.g. after a pose graph optimization) is done by
+    // removing all of them at once and inserting them again. The coordinates are copied.
+    template <int Dim, typename Scalar> class KDForest {
+    public:
+      // a neighbour found by Search: point index of the cloud it was inserted with.
+      // point is valid until the next Insert, Remove or Clear
+      struct Match {
+        int cloud;
+        int index;
+        Scalar dist_sq;
+        const Scalar *point;
+      };
+
+      KDForest() : num_points_(0) {}
+      ~KDForest() { Clear(); }
+
+      // adds the n points (Dim coordinates each, stored consecutively) of the cloud with the given id
+      void Insert(int cloud, const Scalar *points, int n);
+      // removes all points of the cloud with the given id, returns false if there were none
+      bool Remove(int cloud);
+      // removes all points of the given clouds, rebuilding each affected tree only once.
+      // Returns the number of points removed
+      int Remove(const std::vector<int> &clouds);
+      void Clear();
+
+      int NumPoints() const { return num_points_; }
+      int NumTrees() const { return (int)trees_.size(); }
+
+      // The K nearest points to q, sorted by distance. Returns how many were found (less
+      // than K only if the forest holds less points), the missing matches have cloud -1.
+      template <int K> int Search(const Scalar *q, Match *matches) const;
+
+    private:
+      struct Tree {
+        std::vector<Scalar> coords;
+        std::vector<int> cloud; // id of the cloud of each point
+        std::vector<int> index; // index of each point in its cloud
+        KDTree<Dim, Scalar> *tree;
+
+        Tree() : tree(NULL) {}
+        ~Tree() { delete tree; }
+        int Size() const { return (int)cloud.size(); }
+        void Build() {
+          delete tree;
+          tree = new KDTree<Dim, Scalar>(coords.empty() ? NULL : &coords[0], Size());
+        }
+      };
+      static bool LargerTree(const Tree *a, const Tree *b) { return a->Size() > b->Size(); }
+
+      KDForest(const KDForest &); // not copyable
+      KDForest &operator=(const KDForest &);
+
+      std::vector<Tree *> trees_; // in order of decreasing size
+      int num_points_;
+    };
+
+    template <int Dim, typename Scalar>
+    void KDForest<Dim, Scalar>::Insert(int cloud, const Scalar *points, int n)
+    {
+      if(n <= 0) {
+        return;
+      }
+      Tree *t = new Tree;
+      t->coords.assign(points, points + Dim*n);
+      t->cloud.assign(n, cloud);
+      t->index.resize(n);
+      for(int i = 0; i < n; i++) {
+        t->index[i] = i;
+      }
+      trees_.push_back(t);
+      num_points_ += n;
+
+      // merge the newest tree into the next larger one while that one is not much larger
+      while(trees_.size() >= 2 && trees_[trees_.size()-2]->Size() <= 2*trees_.back()->Size()) {
+        Tree *newer = trees_.back();
+        Tree *older = trees_[trees_.size()-2];
+        older->coords.insert(older->coords.end(), newer->coords.begin(), newer->coords.end());
+        older->cloud.insert(older->cloud.end(), newer->cloud.begin(), newer->cloud.end());
+        older->index.insert(older->index.end(), newer->index.begin(), newer->index.end());
+        delete newer;
+        trees_.pop_back();
+      }
+      trees_.back()->Build();
+    }
+
+    template <int Dim, typename Scalar>
+    bool KDForest<Dim, Scalar>::Remove(int cloud)
+    {
+      return Remove(std::vector<int>(1, cloud)) > 0;
+    }
+
+    template <int Dim, typename Scalar>
+    int KDForest<Dim, Scalar>::Remove(const std::vector<int> &clouds)
+    {
+      std::vector<int> sorted(clouds);
+      std::sort(sorted.begin(), sorted.end());
+      int removed = 0;
+      for(size_t j = 0; j < trees_.size(); j++) {
+        Tree *t = trees_[j];
+        int kept = 0;
+        for(int i = 0; i < t->Size(); i++) {
+          if(std::binary_search(sorted.begin(), sorted.end(), t->cloud[i])) {
+            continue;
+          }
+          if(kept < i) {
+            std::copy(&t->coords[Dim*i], &t->coords[Dim*i] + Dim, &t->coords[Dim*kept]);
+            t->cloud[kept] = t->cloud[i];
+            t->index[kept] = t->index[i];
+          }
+          kept++;
+        }
+        if(kept == t->Size()) {
+          continue;
+        }
+        removed += t->Size() - kept;
+        t->coords.resize(Dim*kept);
+        t->cloud.resize(kept);
+        t->index.resize(kept);
+        t->Build();
+      }
+      num_points_ -= removed;
+      if(removed > 0) {
+        for(size_t j = 0; j < trees_.size(); j++) {
+          if(trees_[j]->Size() == 0) {
+            delete trees_[j];
+            trees_[j] = NULL;
+          }
+        }
+        trees_.erase(std::remove(trees_.begin(), trees_.end(), (Tree *)NULL), trees_.end());
+        std::stable_sort(trees_.begin(), trees_.end(), LargerTree);
+      }
+      return removed;
+    }
+
+    template <int Dim, typename Scalar>
+    void KDForest<Dim, Scalar>::Clear()
+    {
+      for(size_t j = 0; j < trees_.size(); j++) {
+        delete trees_[j];
+      }
+      trees_.clear();
+      num_points_ = 0;
+    }
+
+    // The trees are searched from the largest, later ones only for points closer than the
+    // current K-th neighbour
+    template <int Dim, typename Scalar> template <int K>
+    int KDForest<Dim, Scalar>::Search(const Scalar *q, Match *matches) const
+    {
+      int count = 0;
+      for(size_t j = 0; j < trees_.size(); j++) {
+        const Tree *t = trees_[j];
+        Scalar bound = (count < K) ? std::numeric_limits<Scalar>::max() : matches[K-1].dist_sq;
+        int idx[K];
+        Scalar dist_sq[K];
+        int found = t->tree->template SearchBounded<K>(q, idx, dist_sq, bound);
+        for(int k = 0; k < found; k++) { // insert into the sorted matches
+          if(count == K && matches[K-1].dist_sq <= dist_sq[k]) {
+            break; // the rest of this tree's neighbours are even farther
+          }
+          int m = (count < K) ? count++ : K-1;
+          for(; m > 0 && matches[m-1].dist_sq > dist_sq[k]; m--) {
+            matches[m] = matches[m-1];
+          }
+          matches[m].cloud = t->cloud[idx[k]];
+          matches[m].index = t->index[idx[k]];
+          matches[m].dist_sq = dist_sq[k];
+          matches[m].point = &t->coords[Dim*idx[k]];
+        }
+      }
+      for(int k = count; k < K; k++) {
+        matches[k].cloud = -1;
+        matches[k].index = -1;
+        matches[k].dist_sq = std::numeric_limits<Scalar>::max();
+        matches[k].point = NULL;
+      }
+      return count;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,264 @@
+/*************************************************************
+  Generalized-ICP Copyright (c) 2009 Aleksandr Segal.
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with 
+  or without modification, are permitted provided that the 
+  following conditions are met:
+
+* Redistributions of source code must retain the above 
+  copyright notice, this list of conditions and the 
+  following disclaimer.
+* Redistributions in binary form must reproduce the above
+  copyright notice, this list of conditions and the 
+  following disclaimer in the documentation and/or other
+  materials provided with the distribution.
+* The names of the contributors may not be used to endorse
+  or promote products derived from this software
+  without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+  WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+  PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, 
+  INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, 
+  PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE 
+  OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+  DAMAGE.
+*************************************************************/
+
+#include "optimize.h"
+#include <cmath>
+#include <algorithm>
+#include <iostream>
+
+namespace dgc {
+  namespace gicp {
+    // Cost, gradient and Gauss-Newton approximation of the Hessian of the GICP objective
+    // in a single pass over the correspondences. The parameters are a small motion 
+    // (translation v, rotation w) applied on the left of t: q' = R(w)*q + v with q = t*base_t*p1.
+    // Therefore, the jacobian of the residual r = q - p2 is [I | -[q]x]
+    double GICPOptimizer::ComputeSystem(dgc_transform_t t, GICPOptData &opt_data, double H[6][6], double g[6]) {
+      dgc_transform_t T;
+      dgc_transform_copy(T, opt_data.base_t);
+      dgc_transform_left_multiply(T, t);
+
+      // accumulators: sum of M, of M*[q]x, of [q]x*M*[q]x (upper triangle) and the gradient
+      double sM[6] = {0., 0., 0., 0., 0., 0.};
+      double sMQ[3][3] = {{0., 0., 0.}, {0., 0., 0.}, {0., 0., 0.}};
+      double sQMQ[6] = {0., 0., 0., 0., 0., 0.};
+      double gv[3] = {0., 0., 0.}, gw[3] = {0., 0., 0.};
+      double f = 0.;
+
+      int n = opt_data.p1->Size();
+      for(int i = 0; i < n; i++) {
+	int j = opt_data.nn_indecies[i];
+	if(j == -1) {
+	  continue;
+	}
+	float const* p1 = opt_data.p1->Point(i);
+	float const* p2 = opt_data.p2->Point(j);
+	gicp_mat_t &M = opt_data.M[i];
+
+	double q0 = T[0][0]*p1[0] + T[0][1]*p1[1] + T[0][2]*p1[2] + T[0][3];
+	double q1 = T[1][0]*p1[0] + T[1][1]*p1[1] + T[1][2]*p1[2] + T[1][3];
+	double q2 = T[2][0]*p1[0] + T[2][1]*p1[1] + T[2][2]*p1[2] + T[2][3];
+	double r0 = q0 - p2[0], r1 = q1 - p2[1], r2 = q2 - p2[2];
+
+	// M is symmetric
+	double m00 = M[0][0], m01 = M[0][1], m02 = M[0][2], m11 = M[1][1], m12 = M[1][2], m22 = M[2][2];
+	double Mr0 = m00*r0 + m01*r1 + m02*r2;
+	double Mr1 = m01*r0 + m11*r1 + m12*r2;
+	double Mr2 = m02*r0 + m12*r1 + m22*r2;
+	f += r0*Mr0 + r1*Mr1 + r2*Mr2;
+
+	// gradient: J'*M*r = [M*r; q x M*r]
+	gv[0] += Mr0; gv[1] += Mr1; gv[2] += Mr2;
+	gw[0] += q1*Mr2 - q2*Mr1;
+	gw[1] += q2*Mr0 - q0*Mr2;
+	gw[2] += q0*Mr1 - q1*Mr0;
+
+	// translation block
+	sM[0] += m00; sM[1] += m01; sM[2] += m02; sM[3] += m11; sM[4] += m12; sM[5] += m22;
+
+	// A = M*[q]x with [q]x = [[0,-q2,q1],[q2,0,-q0],[-q1,q0,0]]
+	double a00 = m01*q2 - m02*q1, a01 = m02*q0 - m00*q2, a02 = m00*q1 - m01*q0;
+	double a10 = m11*q2 - m12*q1, a11 = m12*q0 - m01*q2, a12 = m01*q1 - m11*q0;
+	double a20 = m12*q2 - m22*q1, a21 = m22*q0 - m02*q2, a22 = m02*q1 - m12*q0;
+	sMQ[0][0] += a00; sMQ[0][1] += a01; sMQ[0][2] += a02;
+	sMQ[1][0] += a10; sMQ[1][1] += a11; sMQ[1][2] += a12;
+	sMQ[2][0] += a20; sMQ[2][1] += a21; sMQ[2][2] += a22;
+
+	// rotation block: -[q]x*M*[q]x = [q]x'*A, row k of [q]x' is column k of [q]x
+	sQMQ[0] +=  q2*a10 - q1*a20;            // (0,0)
+	sQMQ[1] +=  q2*a11 - q1*a21;            // (0,1)
+	sQMQ[2] +=  q2*a12 - q1*a22;            // (0,2)
+	sQMQ[3] += -q2*a01 + q0*a21;            // (1,1)
+	sQMQ[4] += -q2*a02 + q0*a22;            // (1,2)
+	sQMQ[5] +=  q1*a02 - q0*a12;            // (2,2)
+      }
+
+      // scale as in the BFGS cost function (mean over the matches); H and g are of 0.5*f
+      double s = (opt_data.num_matches > 0) ? 1./(double)opt_data.num_matches : 0.;
+      H[0][0] = sM[0]; H[0][1] = sM[1]; H[0][2] = sM[2];
+      H[1][1] = sM[3]; H[1][2] = sM[4]; H[2][2] = sM[5];
+      for(int k = 0; k < 3; k++) {
+	for(int l = 0; l < 3; l++) {
+	  H[k][3+l] = -sMQ[k][l];
+	}
+      }
+      H[3][3] = sQMQ[0]; H[3][4] = sQMQ[1]; H[3][5] = sQMQ[2];
+      H[4][4] = sQMQ[3]; H[4][5] = sQMQ[4]; H[5][5] = sQMQ[5];
+      for(int k = 0; k < 6; k++) {
+	for(int l = k; l < 6; l++) {
+	  H[k][l] *= s;
+	  H[l][k] = H[k][l];
+	}
+      }
+      for(int k = 0; k < 3; k++) {
+	g[k] = gv[k]*s;
+	g[3+k] = gw[k]*s;
+      }
+      return f*s;
+    }
+
+    // Solve the symmetric positive definite system A*x = b (Cholesky decomposition)
+    static bool solve_cholesky6(double A[6][6], double b[6], double x[6]) {
+      double L[6][6];
+      for(int i = 0; i < 6; i++) {
+	for(int j = 0; j <= i; j++) {
+	  double sum = A[i][j];
+	  for(int k = 0; k < j; k++) {
+	    sum -= L[i][k]*L[j][k];
+	  }
+	  if(i == j) {
+	    if(sum <= 0.) {
+	      return false;
+	    }
+	    L[i][i] = sqrt(sum);
+	  }
+	  else {
+	    L[i][j] = sum/L[j][j];
+	  }
+	}
+      }
+      double y[6];
+      for(int i = 0; i < 6; i++) {
+	double sum = b[i];
+	for(int k = 0; k < i; k++) {
+	  sum -= L[i][k]*y[k];
+	}
+	y[i] = sum/L[i][i];
+      }
+      for(int i = 5; i >= 0; i--) {
+	double sum = y[i];
+	for(int k = i+1; k < 6; k++) {
+	  sum -= L[k][i]*x[k];
+	}
+	x[i] = sum/L[i][i];
+      }
+      return true;
+    }
+
+    // t := [R(w) | v] * t, with R(w) the rotation about w by |w| (Rodrigues)
+    static void apply_motion(dgc_transform_t t, double const delta[6]) {
+      double angle = sqrt(delta[3]*delta[3] + delta[4]*delta[4] + delta[5]*delta[5]);
+      dgc_transform_t motion;
+      dgc_transform_identity(motion);
+      if(angle > 0.) {
+	double k[3] = {delta[3]/angle, delta[4]/angle, delta[5]/angle};
+	double c = cos(angle), s = sin(angle), c1 = 1. - c;
+	motion[0][0] = c + k[0]*k[0]*c1;      motion[0][1] = k[0]*k[1]*c1 - k[2]*s; motion[0][2] = k[0]*k[2]*c1 + k[1]*s;
+	motion[1][0] = k[1]*k[0]*c1 + k[2]*s; motion[1][1] = c + k[1]*k[1]*c1;      motion[1][2] = k[1]*k[2]*c1 - k[0]*s;
+	motion[2][0] = k[2]*k[0]*c1 - k[1]*s; motion[2][1] = k[2]*k[1]*c1 + k[0]*s; motion[2][2] = c + k[2]*k[2]*c1;
+      }
+      motion[0][3] = delta[0];
+      motion[1][3] = delta[1];
+      motion[2][3] = delta[2];
+      dgc_transform_left_multiply(t, motion);
+    }
+
+    bool GICPOptimizer::OptimizeLM(dgc_transform_t t, GICPOptData &opt_data) {
+      const double min_step = 1e-7;   // stop for steps below 0.1 micrometers / microradians
+      const double max_lambda = 1e8;  // give up if no step decreases the cost
+      double lambda = 1e-4;
+      double H[6][6], g[6], H_new[6][6], g_new[6];
+      dgc_transform_t t_new;
+
+      double f = ComputeSystem(t, opt_data, H, g);
+      status = GSL_CONTINUE;
+      iter = 0;
+      if(debug) {
+	std::cout << "iter\t\tf-value\t\tlambda" << std::endl;
+	std::cout << iter << "\t\t" << f << "\t\t" << lambda << std::endl;
+      }
+      while(status == GSL_CONTINUE && iter < max_iter) {
+	iter++;
+	// damped normal equations (H + lambda*diag(H)) * delta = -g
+	double A[6][6], b[6], delta[6];
+	for(int k = 0; k < 6; k++) {
+	  for(int l = 0; l < 6; l++) {
+	    A[k][l] = H[k][l];
+	  }
+	  A[k][k] += lambda*H[k][k];
+	  b[k] = -g[k];
+	}
+	if(!opt_data.solve_rotation) { // keep the rotation fixed
+	  for(int k = 3; k < 6; k++) {
+	    for(int l = 0; l < 6; l++) {
+	      A[k][l] = A[l][k] = 0.;
+	    }
+	    A[k][k] = 1.;
+	    b[k] = 0.;
+	  }
+	}
+	if(!solve_cholesky6(A, b, delta)) {
+	  lambda *= 10.;
+	  if(lambda > max_lambda) {
+	    status = GSL_SUCCESS; // no further progress possible (e.g. too few matches)
+	  }
+	  continue;
+	}
+
+	dgc_transform_copy(t_new, t);
+	apply_motion(t_new, delta);
+	double f_new = ComputeSystem(t_new, opt_data, H_new, g_new);
+	if(f_new <= f) { // accept the step
+	  dgc_transform_copy(t, t_new);
+	  f = f_new;
+	  for(int k = 0; k < 6; k++) {
+	    g[k] = g_new[k];
+	    for(int l = 0; l < 6; l++) {
+	      H[k][l] = H_new[k][l];
+	    }
+	  }
+	  lambda = std::max(lambda*0.1, 1e-9);
+	  double step = 0.;
+	  for(int k = 0; k < 6; k++) {
+	    step = std::max(step, fabs(delta[k]));
+	  }
+	  if(step < min_step) {
+	    status = GSL_SUCCESS;
+	  }
+	}
+	else {
+	  lambda *= 10.;
+	  if(lambda > max_lambda) {
+	    status = GSL_SUCCESS; // at a minimum (up to numerical precision)
+	  }
+	}
+	if(debug) {
+	  std::cout << iter << "\t\t" << f << "\t\t" << lambda << std::endl;
+	}
+      }
+      return true;
+    }
+  }
+}
@@ -38,7 +38,6 @@
 #ifndef OPTIMIZE_H_
 #define OPTIMIZE_H_
 
-#include <ANN/ANN.h>
 #include "gicp.h"
 #include <vector>
 #include <gsl/gsl_linalg.h>
@@ -62,7 +61,7 @@ namespace dgc {
     struct GICPOptData {
       GICPPointSet *p1;
       GICPPointSet *p2;
-      ANNidx *nn_indecies; // nearest point indecies
+      int *nn_indecies; // nearest point indecies
       gicp_mat_t *M;      // mahalanobis matrices for each pair
       dgc_transform_t base_t;
       int num_matches;
@@ -78,6 +77,8 @@ namespace dgc {
       const char* Status() { return gsl_strerror(status); }
       
       bool Optimize(dgc_transform_t t, GICPOptData &opt_data);
+      // Levenberg-Marquardt on the Gauss-Newton approximation of the hessian. Usually
+      // converges in a few iterations, with one pass over the matches per iteration.
       bool OptimizeLM(dgc_transform_t t, GICPOptData &opt_data);
       
       void SetDebug(bool d) { debug = d; }
@@ -94,6 +95,8 @@ namespace dgc {
       static void compute_dr(gsl_vector const* x, gsl_matrix const* gsl_temp_mat_r, gsl_vector *g);
       static double mat_inner_prod(gsl_matrix const* mat1, gsl_matrix const* mat2);
       static void apply_state(dgc_transform_t t, gsl_vector const* x);
+      // cost, gradient and (approximate) hessian for OptimizeLM in one pass over the matches
+      static double ComputeSystem(dgc_transform_t t, GICPOptData &opt_data, double H[6][6], double g[6]);
       
       gsl_multimin_fdfminimizer *gsl_minimizer;
       gsl_vector *x;
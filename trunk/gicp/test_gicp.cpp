@@ -154,11 +154,7 @@ bool load_points(GICPPointSet *set, const char* filename) {
   string line;
   GICPPoint pt;
   pt.range = -1;
-  for(int k = 0; k < 3; k++) {
-    for(int l = 0; l < 3; l++) {
-      pt.C[k][l] = (k == l)?1:0;
-    }
-  }    
+  cov_set_identity(pt.C);
   while(getline(in, line)) {
     istringstream sin(line);
     sin >> pt.x >> pt.y >> pt.z;    
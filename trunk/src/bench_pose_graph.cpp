@@ -0,0 +1,130 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares the time to convergence of the pose graph backends, HOG-Man's hierarchical
+// Cholesky optimizer and PoseGraphLM, on saved graphs (e.g. written by rgbdslam with
+// global_pose_graph_file set). Both start from the poses in the file and iterate until
+// chi2 decreases by less than a fraction of 1e-5 (at most 100 iterations). The final chi2
+// of both is evaluated by PoseGraphLM::chi2, so they are comparable.
+//
+// Not part of the regular build (run in src/):
+//   g++ -O2 -I/usr/include/eigen3 -I/usr/include/qt4 -I/usr/include/qt4/QtCore \
+//       `rospack export --lang=cpp --attrib=cflags hogman_minimal` bench_pose_graph.cpp pose_graph_lm.cpp \
+//       `rospack export --lang=cpp --attrib=lflags hogman_minimal` -lQtCore -o bench_pose_graph
+//   ./bench_pose_graph session.graph [...]
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sys/time.h>
+#include <Eigen/Geometry>
+#include <hogman_minimal/graph_optimizer_hogman/graph_optimizer3d_hchol.h>
+#include "pose_graph_lm.h"
+
+using namespace std;
+
+static const int max_iterations = 100;
+static const double min_improvement = 1e-5;
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+static Transformation3 toHogman(const PoseGraphLM::Pose& pose) {
+  Eigen::Quaterniond q(pose.rotation);
+  return Transformation3(Vector3(pose.translation(0), pose.translation(1), pose.translation(2)),
+                         Quaternion(q.x(), q.y(), q.z(), q.w()));
+}
+
+static PoseGraphLM::Pose fromHogman(const Transformation3& t) {
+  Eigen::Quaterniond q(t.rotation().w(), t.rotation().x(), t.rotation().y(), t.rotation().z());
+  return PoseGraphLM::Pose(q.normalized().toRotationMatrix(),
+                           Eigen::Vector3d(t.translation().x(), t.translation().y(), t.translation().z()));
+}
+
+static void print_row(const char *name, int iterations, double setup, double optimization, double chi2) {
+  cout << setw(10) << left << name << right << setw(12) << iterations << setw(12) << setup
+       << setw(12) << optimization << setw(16) << chi2 << endl;
+}
+
+// inserting the edges builds the hierarchy, which is timed separately
+static void bench_hogman(PoseGraphLM graph) {
+  double t0 = now();
+  AIS::HCholOptimizer3D optimizer(3, 2); // as in GraphManager
+  for(int v = 0; v < graph.numVertices(); v++) {
+    optimizer.addVertex(v, toHogman(graph.pose(v)), v == 0 ? 1e9*Matrix6::eye(1.0) : Matrix6::eye(1.0));
+  }
+  for(int i = 0; i < graph.numEdges(); i++) {
+    const PoseGraphLM::Edge &edge = graph.edge(i);
+    Matrix6 information;
+    for(int r = 0; r < 6; r++) {
+      for(int c = 0; c < 6; c++) {
+        information[r][c] = edge.information(r, c);
+      }
+    }
+    optimizer.addEdge(optimizer.vertex(edge.from), optimizer.vertex(edge.to), toHogman(edge.mean), information);
+  }
+  double t1 = now();
+  int iterations = 0;
+  double chi2 = optimizer.chi2();
+  while(iterations < max_iterations) {
+    optimizer.optimize(1, false);
+    iterations++;
+    double improvement = chi2 - optimizer.chi2();
+    chi2 = optimizer.chi2();
+    if(improvement < min_improvement*chi2) {
+      break;
+    }
+  }
+  double t2 = now();
+  for(int v = 0; v < graph.numVertices(); v++) {
+    graph.setPose(v, fromHogman(optimizer.vertex(v)->transformation));
+  }
+  print_row("HOG-Man", iterations, t1 - t0, t2 - t1, graph.chi2());
+}
+
+static void bench_lm(PoseGraphLM graph) {
+  double t0 = now();
+  int iterations = graph.optimize(max_iterations, min_improvement);
+  print_row("LM", iterations, 0., now() - t0, graph.chi2());
+}
+
+int main(int argc, char** argv) {
+  if(argc < 2) {
+    cerr << "usage: " << argv[0] << " graph_file [...]" << endl;
+    return 1;
+  }
+  for(int i = 1; i < argc; i++) {
+    PoseGraphLM graph;
+    ifstream file(argv[i]);
+    if(!file || !graph.load(file)) {
+      cerr << "could not read " << argv[i] << endl;
+      continue;
+    }
+    cout << argv[i] << ": " << graph.numVertices() << " vertices, " << graph.numEdges()
+         << " edges, initial chi2 " << graph.chi2() << endl;
+    cout << setw(10) << "" << setw(12) << "iterations" << setw(12) << "setup [s]"
+         << setw(12) << "optimize [s]" << setw(16) << "chi2" << endl;
+    cout << fixed << setprecision(3);
+    bench_hogman(graph);
+    bench_lm(graph);
+    cout.unsetf(ios::floatfield);
+    cout << endl;
+  }
+  return 0;
+}
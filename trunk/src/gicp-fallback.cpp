@@ -80,85 +80,72 @@ void downSample(const PointCloud_RGB& src, PointCloud_RGB& to){
 
 
 
-bool gicpfallback(const PointCloud_RGB& from, const PointCloud_RGB& to, Eigen::Matrix4f& transform){
-
-	// std::clock_t starttime_gicp = std::clock();
-	
-    FILE *fp;
-    char f1[200];
-    char f2[200];
-
-    char line[130];
-    char cmd[200];
-
-    sprintf(f1, "pc1.txt");
-    sprintf(f2, "pc2.txt");
-
-    // default values for algo work well on this data
-    sprintf(cmd, "./gicp/test_gicp %s %s --d_max 0.01  --debug 0",f1,f2); 
+#ifdef USE_ICP_BIN
+///Fill a GICPPointSet with at most max_cnt (evenly spaced) valid points of the cloud
+static void cloudToPointSet(const PointCloud_RGB& pc, dgc::gicp::GICPPointSet& set, const unsigned int max_cnt){
+    int step = 1;
+    if (pc.points.size()>max_cnt)
+        step = floor(pc.points.size()*1.0/max_cnt);
+
+    dgc::gicp::GICPPoint g_p;
+    g_p.range = -1;
+    dgc::gicp::cov_set_identity(g_p.C);
+
+    for (unsigned int i=0; i<pc.points.size(); i += step){
+        const Point& p = pc.points[i];
+        if (isnan(p.x) || isnan(p.y) || isnan(p.z))
+            continue;
+        g_p.x = p.x;
+        g_p.y = p.y;
+        g_p.z = p.z;
+        set.AppendPoint(g_p);
+    }
+}
 
-    int N = 40000;
-    
-    saveCloud(f1,from,N);
-    saveCloud(f2,to,N);
+bool gicpfallback(const PointCloud_RGB& from, const PointCloud_RGB& to, Eigen::Matrix4f& transform, GICPResult* result){
 
-    // cout << "time for writing: " << ((std::clock()-starttime_gicp*1.0) / (double)CLOCKS_PER_SEC) << endl;
-    // std::clock_t starttime_gicp2 = std::clock();
-    
-    /*
-     ICP is calculated by external program. It writes some intermediate results
-     and the final homography on stdout, which is parsed here.
-     Not very beautiful, but works :)
-     */
-    fp = popen(cmd, "r");
+    // same parameters as formerly used for the call of ./gicp/test_gicp
+    const unsigned int max_cnt = 40000;
+    const double gicp_epsilon = 1e-3;
+    const double d_max = 0.01;
+    const int max_iterations = 200;
 
-    vector<string> lines;
+    // all state is local, so concurrent calls (for different node pairs) do not interfere
+    dgc::gicp::GICPPointSet p1, p2;
+    cloudToPointSet(from, p1, max_cnt);
+    cloudToPointSet(to, p2, max_cnt);
 
-    // collect all output
-    while ( fgets( line, sizeof line, fp))
-    {
-        lines.push_back(line);
-        // ROS_INFO("gicp.cpp: %s", line);
-    }
-    int retval = pclose(fp);
-   // cout << "time for binary: " << ((std::clock()-starttime_gicp2*1.0) / (double)CLOCKS_PER_SEC) << endl;
-
-   // std::clock_t starttime_gicp3 = std::clock();
-        
-    if(retval != 0){
-        ROS_ERROR_ONCE("Non-zero return value from %s: %i. Identity transformation is returned instead of GICP result.\nThis error will be reported only once.", cmd, retval);
-        transform = Eigen::Matrix<float, 4, 4>::Identity();
+    GICPResult res;
+    transform = Eigen::Matrix<float, 4, 4>::Identity();
+    if (p1.Size() == 0 || p2.Size() == 0){
+        ROS_WARN("gicp.cpp: Empty point cloud given to GICP (%i and %i points)", p1.Size(), p2.Size());
+        if (result != NULL) *result = res;
         return false;
     }
 
-    int pos = 0;
-    // last lines contain the transformation:
-    for (unsigned int i=lines.size()-5; i<lines.size()-1; i++){
-    	
-        stringstream ss(lines.at(i));
-        for (int j=0; j<4; j++)
-        {
-            ss >> line;
-            transform(pos,j) = atof(line);
-        }
-        // cout << endl;
-        pos++;
-    }
-    
-    // read the number of iterations:
-    stringstream ss(lines.at(lines.size()-1));
-    ss >> line; // Converged in
-    ss >> line;
-    ss >> line;
-        
-    int iter_cnt;
-    iter_cnt = atoi(line);
-    
-    return iter_cnt < 200; // check test_gicp for maximal allowed number of iterations
-    
-    // ROS_INFO_STREAM("Parsed: Converged in " << iter_cnt << "iterations");
-    
-    
-    // ROS_DEBUG_STREAM("Matrix read from ICP process: " << transform);
-    // ROS_INFO_STREAM("Paper: time for icp1 (internal): " << ((std::clock()-starttime_gicp*1.0) / (double)CLOCKS_PER_SEC));
+    p1.SetGICPEpsilon(gicp_epsilon);
+    p2.SetGICPEpsilon(gicp_epsilon);
+    p1.BuildKDTree();
+    p1.ComputeMatrices();
+    p2.BuildKDTree();
+    p2.ComputeMatrices();
+
+    dgc_transform_t t_base, t;
+    dgc_transform_identity(t_base);
+    dgc_transform_identity(t);
+    p2.SetDebug(false);
+    p2.SetMaxIterationInner(8);
+    p2.SetMaxIteration(max_iterations);
+    res.iterations = p2.AlignScan(&p1, t_base, t, d_max, false, &res.residual, &res.matches);
+    res.converged = res.iterations < max_iterations;
+
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            transform(i,j) = t[i][j];
+
+    ROS_DEBUG("gicp.cpp: %s in %i iterations, %i correspondences, residual %.2f cm",
+              res.converged ? "Converged" : "Did not converge", res.iterations, res.matches, res.residual*100);
+    if (result != NULL) *result = res;
+    return res.converged;
 }
+#endif
@@ -28,6 +28,9 @@
 #include <pcl/registration/icp.h>
 #include <pcl/registration/registration.h>
 #include <Eigen/Core>
+#ifdef USE_ICP_BIN
+#include "../gicp/gicp.h"
+#endif
 
 typedef pcl::PointXYZRGB Point;
 typedef pcl::PointCloud<pcl::PointXYZRGB> PointCloud_RGB;
@@ -37,7 +40,21 @@ void saveCloud(const char* filename, const PointCloud_RGB& pc, const unsigned in
 
 void downSample(const PointCloud_RGB& src, PointCloud_RGB& to);
 
-bool gicpfallback(const PointCloud_RGB& from, const PointCloud_RGB& to, Eigen::Matrix4f& transform);
+#ifdef USE_ICP_BIN
+///Outcome of a GICP registration
+struct GICPResult {
+    GICPResult() : iterations(0), matches(0), residual(0.0), converged(false) {}
+    int iterations;  ///< outer GICP iterations
+    int matches;     ///< number of point correspondences in the last iteration
+    double residual; ///< rms distance of these correspondences after the alignment (in m)
+    bool converged;  ///< false if the maximal number of iterations was reached
+};
+
+///Align from to to with the gicp library (in process, no files or external binary involved).
+///Every call uses its own point sets, so it can be called concurrently for several node pairs.
+///Returns true if GICP converged
+bool gicpfallback(const PointCloud_RGB& from, const PointCloud_RGB& to, Eigen::Matrix4f& transform, GICPResult* result = NULL);
+#endif
 
 
 
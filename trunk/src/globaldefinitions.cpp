@@ -65,3 +65,38 @@ const bool global_preserve_raster_on_save =false;
 ///Maximally this many comparisons per node
 ///(lower=faster, higher=better loop closing)
 const unsigned int global_connectivity = 10;
+
+///In node.cpp
+///Seed of the RANSAC sampling. 0 seeds from the clock, any other value
+///makes the registration (and thus the whole run) reproducible
+const unsigned int global_ransac_seed = 0;
+///The RANSAC hypotheses are split into this many independently seeded 
+///streams, which are evaluated in parallel. The result does not depend
+///on the number of cores, only on this value (and the seed)
+const unsigned int global_ransac_streams = 8;
+///Refine the RANSAC result of each edge by dense point-to-plane ICP. Points are 
+///associated by projecting them into the depth image of the other node
+const bool global_use_projective_icp = true;
+
+///In graph_manager.cpp
+///Every n-th point of every n-th row of each node is inserted into the spatial 
+///index of the map (see GraphManager::mapIndex). 0 disables the index
+const int global_map_index_step = 0; //nothing queries the index yet
+const double global_map_index_tolerance = 0.01;
+///Optimize the pose graph in a background thread. Frames are then processed
+///without waiting for the optimizer, the poses are updated when it is done
+const bool global_concurrent_optimization = true;
+///Optimize the pose graph only when a loop is closed (an edge to a node that is not
+///one of the last few) or when chi2 grew by more than global_optimizer_chi2_threshold 
+///since the last optimization
+const bool global_incremental_optimization = true;
+///chi2 is in units of the kinect noise (the information matrices of the edges weight an error
+///by the depth and pixel noise of its inliers, a few mm at 1m). A consistent edge adds about 6,
+///but an edge with 100 inliers at 1m already adds about 1000 if it is off by 1cm
+const float global_optimizer_chi2_threshold = 1000;
+///Pose graph optimizer: "hogman" (hierarchical Cholesky of HOG-Man) or "lm"
+///(Levenberg-Marquardt with a block-sparse Cholesky solver, see pose_graph_lm.h)
+const char* global_optimizer_backend = "hogman";
+///The pose graph is written to this file when the graph is reset or the program ends,
+///see PoseGraphLM::save. Empty: not saved
+const char* global_pose_graph_file = "";
@@ -78,4 +78,40 @@ extern const bool global_preserve_raster_on_save;
 ///Maximally this many comparisons per node
 ///(lower=faster, higher=better loop closing)
 extern const unsigned int global_connectivity;
+
+///In node.cpp
+///Seed of the RANSAC sampling. 0 seeds from the clock, any other value
+///makes the registration (and thus the whole run) reproducible
+extern const unsigned int global_ransac_seed;
+///The RANSAC hypotheses are split into this many independently seeded 
+///streams, which are evaluated in parallel
+extern const unsigned int global_ransac_streams;
+///Refine the RANSAC result of each edge by dense point-to-plane ICP. Points are 
+///associated by projecting them into the depth image of the other node
+extern const bool global_use_projective_icp;
+
+///In graph_manager.cpp
+///Every n-th point of every n-th row of each node is inserted into the spatial 
+///index of the map (see GraphManager::mapIndex). 0 disables the index
+extern const int global_map_index_step;
+///The points of a node are reinserted into the map index when an optimization 
+///moved the node by more than this (in m, and rad for the rotation)
+extern const double global_map_index_tolerance;
+///Optimize the pose graph in a background thread. Frames are then processed
+///without waiting for the optimizer, the poses are updated when it is done
+extern const bool global_concurrent_optimization;
+///Optimize the pose graph only when a loop is closed (an edge to a node that is not
+///one of the last few) or when chi2 grew by more than global_optimizer_chi2_threshold 
+///since the last optimization
+extern const bool global_incremental_optimization;
+///chi2 is in units of the kinect noise (the information matrices of the edges weight an error
+///by the depth and pixel noise of its inliers, a few mm at 1m). A consistent edge adds about 6,
+///but an edge with 100 inliers at 1m already adds about 1000 if it is off by 1cm
+extern const float global_optimizer_chi2_threshold;
+///Pose graph optimizer: "hogman" (hierarchical Cholesky of HOG-Man) or "lm"
+///(Levenberg-Marquardt with a block-sparse Cholesky solver, see pose_graph_lm.h)
+extern const char* global_optimizer_backend;
+///The pose graph is written to this file when the graph is reset or the program ends,
+///see PoseGraphLM::save. Empty: not saved
+extern const char* global_pose_graph_file;
 #endif
@@ -22,6 +22,7 @@
 #include <geometry_msgs/Point.h>
 //#include <rgbdslam/CloudTransforms.h>
 #include "graph_manager.h"
+#include "pose_graph_lm.h"
 #include "pcl_ros/transforms.h"
 #include "pcl/io/pcd_io.h"
 #include <sensor_msgs/PointCloud2.h>
@@ -31,6 +32,8 @@
 #include <QtConcurrentMap> 
 #include <QFile>
 #include <utility>
+#include <fstream>
+#include <cstring>
 
 
 
@@ -65,6 +68,39 @@ tf::Transform hogman2TF(const Transformation3 hogman_trans) {
 
 }
 
+PoseGraphLM::Pose hogman2LM(const Transformation3& hogman_trans) {
+    Eigen::Quaterniond rotation(hogman_trans.rotation().w(), hogman_trans.rotation().x(),
+				hogman_trans.rotation().y(), hogman_trans.rotation().z());
+    Eigen::Vector3d translation(hogman_trans.translation().x(), hogman_trans.translation().y(),
+				hogman_trans.translation().z());
+    return PoseGraphLM::Pose(rotation.normalized().toRotationMatrix(), translation);
+}
+
+Transformation3 lm2Hogman(const PoseGraphLM::Pose& pose) {
+    Eigen::Quaterniond rotation(pose.rotation);
+    Vector3 translation(pose.translation(0), pose.translation(1), pose.translation(2));
+    return Transformation3(translation, Quaternion(rotation.x(), rotation.y(), rotation.z(), rotation.w()));
+}
+
+///The vertices of optimizer (ids 0 to n-1, the first one fixed) and the given edges
+void hogman2PoseGraph(AIS::GraphOptimizer3D* optimizer, const std::vector<AIS::LoadedEdge3D>& edges, PoseGraphLM& graph) {
+    graph.clear();
+    for (unsigned int i = 0; i < optimizer->vertices().size(); ++i) {
+	graph.addVertex(hogman2LM(optimizer->vertex(i)->transformation), i == 0);
+    }
+    for (unsigned int i = 0; i < edges.size(); ++i) {
+	PoseGraphLM::Matrix6d information;
+	for(int r = 0; r < 6; r++)
+	    for(int c = 0; c < 6; c++)
+		information(r,c) = edges[i].informationMatrix[r][c];
+	graph.addEdge(edges[i].id1, edges[i].id2, hogman2LM(edges[i].mean), information);
+    }
+}
+
+///New nodes are always compared to this many of their predecessors (see getPotentialEdgeTargets), 
+///edges to earlier nodes close loops
+static const int last_targets = 3;
+
 void printTransform(const char* name, const tf::Transform t) {
     ROS_DEBUG_STREAM(name << ": Translation " << t.getOrigin().x() << " " << t.getOrigin().y() << " " << t.getOrigin().z());
     ROS_DEBUG_STREAM(name << ": Rotation " << t.getRotation().getX() << " " << t.getRotation().getY() << " " << t.getRotation().getZ() << " " << t.getRotation().getW());
@@ -76,6 +112,18 @@ GraphManager::GraphManager(ros::NodeHandle nh, GLViewer* glviewer) :
     glviewer_(glviewer),
     time_of_last_transform_(ros::Time()),
     optimizer_(0), 
+    edges_sent_(0),
+    graph_generation_(0),
+    adopted_optimization_(0),
+    optimizations_(0),
+    pending_request_(NULL),
+    optimizer_thread_runs_(false),
+    background_optimizer_(NULL),
+    background_generation_(0),
+    full_optimization_pending_(false),
+    chi2_after_optimization_(0.0),
+    optimizer_runs_(0),
+    optimizer_iterations_(0),
     latest_transform_(), //constructs identity
     reset_request_(false),
     last_batch_update_(std::clock()),
@@ -103,6 +151,9 @@ GraphManager::GraphManager(ros::NodeHandle nh, GLViewer* glviewer) :
 GraphManager::~GraphManager() {
   //TODO: delete all Nodes
     //for (unsigned int i = 0; i < optimizer_->vertices().size(); ++i) {
+    optimizer_thread_.waitForFinished(); //finishes the pending request
+    savePoseGraph();
+    delete background_optimizer_;
     delete (optimizer_);
 }
 
@@ -161,7 +212,7 @@ void GraphManager::drawFeatureFlow(cv::Mat& canvas, cv::Scalar line_color,
 /// max_targets = 1: Compare to previous frame only
 /// max_targets > 1: Select intelligently (TODO: rather stupid at the moment)
 std::vector<int> GraphManager::getPotentialEdgeTargets(const Node* new_node, int max_targets){
-    const int last_targets = 3; //always compare to the last n, spread evenly for the rest
+    //always compare to the last_targets, spread evenly for the rest
     double max_id_plus1 = (double)graph_.size()- last_targets;
     max_targets -= last_targets;
     std::vector<int> ids_to_link_to;
@@ -220,9 +271,21 @@ void GraphManager::resetGraph(){
     marker_id =0;
     time_of_last_transform_= ros::Time();
     last_batch_update_=std::clock();
+    savePoseGraph();
     delete optimizer_; 
     optimizer_ = new AIS::HCholOptimizer3D(numLevels, nodeDistance);
     graph_.clear();//TODO: also delete the nodes
+    map_index_.Clear();
+    map_index_poses_.clear();
+    edges_.clear();
+    edges_sent_ = 0;
+    full_optimization_pending_ = false;
+    chi2_after_optimization_ = 0.0;
+    {
+      QMutexLocker locker(&pose_mutex_);
+      graph_generation_++; //results of the background optimizer are obsolete
+      poses_.reset();
+    }
     freshlyOptimized_= false;
     reset_request_ = false;
 }
@@ -248,8 +311,14 @@ bool GraphManager::addNode(Node* new_node) {
     //vertex at the origin, of which the position is very certain
     if (graph_.size()==0){
 	new_node->buildFlannIndex(); // create index so that next nodes can use it
+	if (global_use_projective_icp) new_node->computeDenseNormals();
+#ifdef USE_ICP_CODE
+	new_node->startGICPStructures();
+#endif
 	graph_[new_node->id_] = new_node;
 	optimizer_->addVertex(0, Transformation3(), 1e9*Matrix6::eye(1.0)); //fix at origin
+	publishOptimizerPoses();
+	addToMapIndex(new_node);
 	QString message;
 	Q_EMIT setGUIInfo(message.sprintf("Added first node with %i keypoints to the graph", (int)new_node->feature_locations_2d_.size()));
 	pointcloud_type const * the_pc(&(new_node->pc_col));
@@ -274,32 +343,16 @@ bool GraphManager::addNode(Node* new_node) {
     if(mr.edge.id1 >= 0 && !isBigTrafo(mr.edge.mean)){
 	ROS_WARN("Transformation not relevant. Did not add as Node");
 	return false;
-    } else if(mr.edge.id1 >= 0){
-	if (addEdgeToHogman(mr.edge, true)) {
-	    
-	  // <save indices of matching points>
-	  
-	  
-
-      // add indices of matching points in the corresponding list
-      for (uint i=0; i<mr.inlier_matches.size(); i++)
-      {
-	int this_id    = mr.inlier_matches.at(i).queryIdx;
-	int earlier_id = mr.inlier_matches.at(i).trainIdx;
-
-	new_node->matched_features.push_back(this_id);
-	prev_frame->matched_features.push_back(earlier_id); 
-      }
-
-// <!save indices of matching points>
-
-
-	  
-	  ROS_INFO("Added Edge between %i and %i. Inliers: %i",mr.edge.id1,mr.edge.id2,(int) mr.inlier_matches.size());
-	    last_matching_node_ = mr.edge.id1;
-	    last_inlier_matches_ = mr.inlier_matches;
-	    last_matches_ = mr.all_matches;
-	}
+    }
+    //The edges are inserted after all comparisons. Meanwhile, the GICP structures of the 
+    //(then accepted) node are built in the background, which the ICP refinement needs
+    QList<MatchingResult> edge_candidates;
+    bool prev_frame_matched = (mr.edge.id1 >= 0);
+    if(prev_frame_matched){
+	edge_candidates.push_back(mr);
+#ifdef USE_ICP_CODE
+	new_node->startGICPStructures();
+#endif
     }
     //Eigen::Matrix4f ransac_trafo, final_trafo;
     std::vector<int> vertices_to_comp = getPotentialEdgeTargets(new_node, global_connectivity); //vernetzungsgrad
@@ -325,36 +378,51 @@ bool GraphManager::addNode(Node* new_node) {
 	MatchingResult mr = new_node->matchNodePair(abcd);
 #endif
 	if(mr.edge.id1 >= 0){
-	    if (addEdgeToHogman(mr.edge, isBigTrafo(mr.edge.mean))) { //TODO: result isBigTrafo is not considered
-		ROS_INFO("Added Edge between %i and %i. Inliers: %i",mr.edge.id1,mr.edge.id2,(int) mr.inlier_matches.size());
-		last_matching_node_ = mr.edge.id1;
-		last_inlier_matches_ = mr.inlier_matches;
-		last_matches_ = mr.all_matches;
-		
-		// <save indices of matching points>
-
-		// add indices of matching points in the corresponding list
-		for (uint i=0; i<mr.inlier_matches.size(); i++)
-		{
-		  int this_id    = mr.inlier_matches.at(i).queryIdx;
-		  int earlier_id = mr.inlier_matches.at(i).trainIdx;
-
-		  new_node->matched_features.push_back(this_id);
-		  abcd->matched_features.push_back(earlier_id); 
-		}
-
-		  // <!save indices of matching points>
-		
+	    edge_candidates.push_back(mr);
+#ifdef USE_ICP_CODE
+	    new_node->startGICPStructures();
+#endif
+	}
+    }
+
+    for(int i = 0; i < edge_candidates.size(); i++){
+	MatchingResult& mr = edge_candidates[i];
+	Node* older_node = graph_[mr.edge.id1];
+#ifdef USE_ICP_CODE
+	//waits for the GICP structures of new_node, the ones of older_node are cached
+	new_node->refineEdgeICP_code(older_node, mr);
+#endif
+	bool large_edge = (i == 0 && prev_frame_matched) ? true : isBigTrafo(mr.edge.mean); //TODO: result isBigTrafo is not considered
+	if (addEdgeToHogman(mr.edge, large_edge)) {
+	    ROS_INFO("Added Edge between %i and %i. Inliers: %i",mr.edge.id1,mr.edge.id2,(int) mr.inlier_matches.size());
+	    last_matching_node_ = mr.edge.id1;
+	    last_inlier_matches_ = mr.inlier_matches;
+	    last_matches_ = mr.all_matches;
+
+	    // <save indices of matching points>
+
+	    // add indices of matching points in the corresponding list
+	    for (uint j=0; j<mr.inlier_matches.size(); j++)
+	    {
+		int this_id    = mr.inlier_matches.at(j).queryIdx;
+		int earlier_id = mr.inlier_matches.at(j).trainIdx;
+
+		new_node->matched_features.push_back(this_id);
+		older_node->matched_features.push_back(earlier_id); 
 	    }
+
+	    // <!save indices of matching points>
 	}
     }
     //END OF MAIN LOOP: Compare node pairs ######################################################################
 
     if (optimizer_->edges().size() > num_edges_before) { //Success
 	new_node->buildFlannIndex();
+	if (global_use_projective_icp) new_node->computeDenseNormals(); //as target of the next nodes
 	graph_[new_node->id_] = new_node;
 	ROS_INFO("Added Node, new Graphsize: %i", (int) graph_.size());
 	optimizeGraph();
+	addToMapIndex(new_node);
 	Q_EMIT updateTransforms(getAllPosesAsMatrixList());
 	Q_EMIT setGraphEdges(getGraphEdges());
 	//make the transform of the last node known
@@ -737,15 +805,23 @@ bool GraphManager::addEdgeToHogman(AIS::LoadedEdge3D edge, bool largeEdge) {
 	}
     }
 
+    //A new vertex starts where the edge puts it relative to the known one (instead of at
+    //the origin), so the optimizer does not have to drag it there. In incremental mode, 
+    //the graph may not even be optimized after this edge
     if (!v1) {
-	v1 = optimizer_->addVertex(edge.id1, Transformation3(), Matrix6::eye(1.0));
+	v1 = optimizer_->addVertex(edge.id1, v2 ? v2->transformation * edge.mean.inverse() : Transformation3(), Matrix6::eye(1.0));
 	assert(v1);
     }
     if (!v2) {
-	v2 = optimizer_->addVertex(edge.id2, Transformation3(), Matrix6::eye(1.0));
+	v2 = optimizer_->addVertex(edge.id2, v1->transformation * edge.mean, Matrix6::eye(1.0));
 	assert(v2);
     }
     optimizer_->addEdge(v1, v2, edge.mean, edge.informationMatrix);
+    edges_.push_back(edge);
+    if (std::abs(edge.id2 - edge.id1) > last_targets){
+	ROS_INFO("Edge between %i and %i closes a loop", edge.id1, edge.id2);
+	full_optimization_pending_ = true;
+    }
     ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "function runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec"); 
 
     return true;
@@ -754,18 +830,37 @@ bool GraphManager::addEdgeToHogman(AIS::LoadedEdge3D edge, bool largeEdge) {
 
 void GraphManager::optimizeGraph(){
     std::clock_t starttime=std::clock();
-    const int iterations = 10;
-    int currentIt = optimizer_->optimize(iterations, true);
+    if(global_concurrent_optimization) adoptOptimizedPoses();
+
+    bool optimize = true;
+    if(global_incremental_optimization && !full_optimization_pending_){
+	//only odometry was added, which the new vertices already comply with.
+	//Optimize only if the remaining edges between them disagree too much
+	double chi2_growth = optimizer_->chi2() - chi2_after_optimization_;
+	optimize = chi2_growth > global_optimizer_chi2_threshold;
+	ROS_INFO("No loop closure, chi2 grew by %f since the last optimization%s", chi2_growth, optimize ? ", optimizing" : "");
+    }
 
-    ROS_INFO_STREAM("Hogman Statistics: " << optimizer_->vertices().size() << " nodes, " 
-		    << optimizer_->edges().size() << " edges. "
-		    << "chi2: " << optimizer_->chi2()
-		    << ", Iterations: " << currentIt);
+    if(optimize) full_optimization_pending_ = false;
+    if(optimize && global_concurrent_optimization){
+	requestOptimization();
+	//the following frames are compared to the state sent to the optimizer, otherwise each of
+	//them would issue another request until the result is adopted
+	chi2_after_optimization_ = optimizer_->chi2();
+    } else if(optimize){
+	const int iterations = 10;
+	double chi2_before = optimizer_->chi2();
+	int currentIt = runOptimizer(optimizer_, edges_, iterations);
+	logOptimizerStatistics("", optimizer_, chi2_before, currentIt);
+	chi2_after_optimization_ = optimizer_->chi2();
+	QMutexLocker locker(&pose_mutex_);
+	adopted_optimization_ = ++optimizations_;
+    }
 
     freshlyOptimized_ = true;
+    publishOptimizerPoses();
 
     AISNavigation::PoseGraph3D::Vertex* v = optimizer_->vertex(optimizer_->vertices().size()-1);
-    kinect_transform_ =  hogman2TF(v->transformation);
     //pcl_ros::transformAsMatrix(kinect_transform_, latest_transform_);
     latest_transform_ = hogman2QMatrix(v->transformation); 
 
@@ -777,12 +872,189 @@ void GraphManager::optimizeGraph(){
     ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "function runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec"); 
 }
 
+void GraphManager::logOptimizerStatistics(const char* which, AIS::GraphOptimizer3D* optimizer, double chi2_before, int iterations){
+    unsigned int total_iterations, runs;
+    {
+      QMutexLocker locker(&pose_mutex_);
+      total_iterations = optimizer_iterations_ += iterations;
+      runs = ++optimizer_runs_;
+    }
+    ROS_INFO_STREAM("Optimizer Statistics (" << global_optimizer_backend << ")" << which << ": " << optimizer->vertices().size() << " nodes, " 
+		    << optimizer->edges().size() << " edges. "
+		    << "chi2: " << chi2_before << " -> " << optimizer->chi2()
+		    << ", Iterations: " << iterations);
+    ROS_INFO_STREAM_NAMED("statistics", "Optimizer runs: " << runs << ", iterations: " << total_iterations 
+			  << " (" << total_iterations / (double)runs << " per run)");
+}
+
+int GraphManager::runOptimizer(AIS::GraphOptimizer3D* optimizer, const std::vector<AIS::LoadedEdge3D>& edges, int iterations){
+    if(std::strcmp(global_optimizer_backend, "lm") != 0)
+	return optimizer->optimize(iterations, true);
+
+    //The HOG-Man graph stays the representation of the graph (e.g. for chi2),
+    //only its vertices are moved to the results
+    PoseGraphLM graph;
+    hogman2PoseGraph(optimizer, edges, graph);
+    int currentIt = graph.optimize(iterations);
+    for (unsigned int i = 0; i < optimizer->vertices().size(); ++i) {
+	optimizer->vertex(i)->transformation = lm2Hogman(graph.pose(i));
+    }
+    return currentIt;
+}
+
+void GraphManager::savePoseGraph(){
+    if(global_pose_graph_file[0] == '\0' || optimizer_->vertices().empty()) return;
+    PoseGraphLM graph;
+    hogman2PoseGraph(optimizer_, edges_, graph);
+    std::ofstream file(global_pose_graph_file);
+    graph.save(file);
+    if(file) ROS_INFO("Saved the pose graph (%d nodes, %d edges) to %s", graph.numVertices(), graph.numEdges(), global_pose_graph_file);
+    else ROS_ERROR("Could not save the pose graph to %s", global_pose_graph_file);
+}
+
+void GraphManager::publishOptimizerPoses(){
+    PoseBuffer* poses = new PoseBuffer();
+    poses->optimization = adopted_optimization_;
+    poses->generation = graph_generation_; //only modified in this thread
+    for (unsigned int i = 0; i < optimizer_->vertices().size(); ++i) {
+	poses->poses.push_back(optimizer_->vertex(i)->transformation);
+    }
+    publishPoses(poses);
+}
+
+PoseBufferPtr GraphManager::currentPoses() const {
+    QMutexLocker locker(&pose_mutex_);
+    return poses_;
+}
+
+void GraphManager::publishPoses(PoseBuffer* poses){
+    std::auto_ptr<PoseBuffer> fresh(poses);
+    QMutexLocker locker(&pose_mutex_);
+    if(fresh->generation != graph_generation_) return; //vertices were removed in the meantime
+
+    PoseBufferPtr other = poses_;
+    if(other && other->generation == fresh->generation){
+	if(other->optimization > fresh->optimization){ //keep the later optimizer run
+	    PoseBuffer* later = new PoseBuffer(*other);
+	    other.reset(fresh.release());
+	    fresh.reset(later);
+	}
+	std::vector<Transformation3>& p = fresh->poses;
+	const std::vector<Transformation3>& q = other->poses;
+	if(!p.empty() && q.size() > p.size()){
+	    unsigned int last = p.size()-1;
+	    Transformation3 correction = p[last] * q[last].inverse();
+	    for(unsigned int i = p.size(); i < q.size(); i++) p.push_back(correction * q[i]);
+	}
+    }
+    poses_.reset(fresh.release());
+}
+
+void GraphManager::adoptOptimizedPoses(){
+    PoseBufferPtr latest = currentPoses();
+    if(!latest || latest->generation != graph_generation_ || latest->optimization <= adopted_optimization_) return;
+
+    const std::vector<Transformation3>& p = latest->poses;
+    unsigned int num_vertices = optimizer_->vertices().size();
+    unsigned int known = std::min((unsigned int)p.size(), num_vertices);
+    if(known == 0) return;
+    //vertices added after the request are moved along with the last one of the request 
+    Transformation3 correction = p[known-1] * optimizer_->vertex(known-1)->transformation.inverse();
+    for (unsigned int i = 0; i < num_vertices; ++i) {
+	AIS::PoseGraph3D::Vertex* v = optimizer_->vertex(i);
+	v->transformation = i < known ? p[i] : correction * v->transformation;
+    }
+    adopted_optimization_ = latest->optimization;
+    chi2_after_optimization_ = optimizer_->chi2();
+    ROS_DEBUG("Adopted the poses of optimizer run %u", adopted_optimization_);
+}
+
+void GraphManager::requestOptimization(){
+    OptimizerRequest* request = new OptimizerRequest();
+    request->generation = graph_generation_;
+    for (unsigned int i = 0; i < optimizer_->vertices().size(); ++i) {
+	request->poses.push_back(optimizer_->vertex(i)->transformation);
+    }
+    request->edges.assign(edges_.begin() + edges_sent_, edges_.end());
+    edges_sent_ = edges_.size();
+
+    QMutexLocker locker(&request_mutex_);
+    if(pending_request_){ //still busy, merge with the waiting request
+	if(pending_request_->generation == request->generation){
+	    request->edges.insert(request->edges.begin(), pending_request_->edges.begin(), pending_request_->edges.end());
+	}
+	delete pending_request_;
+	ROS_DEBUG("Background optimizer is busy, merged the optimization requests");
+    }
+    pending_request_ = request;
+    if(!optimizer_thread_runs_){
+	optimizer_thread_runs_ = true;
+	optimizer_thread_ = QtConcurrent::run(this, &GraphManager::optimizerLoop);
+    }
+}
+
+void GraphManager::optimizerLoop(){
+    while(true){
+	std::auto_ptr<OptimizerRequest> request;
+	{
+	    QMutexLocker locker(&request_mutex_);
+	    if(!pending_request_){
+		optimizer_thread_runs_ = false;
+		return;
+	    }
+	    request.reset(pending_request_);
+	    pending_request_ = NULL;
+	}
+	std::clock_t starttime=std::clock();
+
+	if(!background_optimizer_ || request->generation != background_generation_){ //start over
+	    delete background_optimizer_;
+	    int numLevels = 3;
+	    int nodeDistance = 2;
+	    background_optimizer_ = new AIS::HCholOptimizer3D(numLevels, nodeDistance);
+	    background_edges_.clear();
+	    background_generation_ = request->generation;
+	}
+	//new vertices start from the estimate of the graph manager
+	for (unsigned int i = background_optimizer_->vertices().size(); i < request->poses.size(); ++i) {
+	    background_optimizer_->addVertex(i, request->poses[i], i == 0 ? 1e9*Matrix6::eye(1.0) : Matrix6::eye(1.0));
+	}
+	for (unsigned int i = 0; i < request->edges.size(); ++i) {
+	    const AIS::LoadedEdge3D& edge = request->edges[i];
+	    background_optimizer_->addEdge(background_optimizer_->vertex(edge.id1), background_optimizer_->vertex(edge.id2), 
+					   edge.mean, edge.informationMatrix);
+	}
+	background_edges_.insert(background_edges_.end(), request->edges.begin(), request->edges.end());
+
+	const int iterations = 10;
+	double chi2_before = background_optimizer_->chi2();
+	int currentIt = runOptimizer(background_optimizer_, background_edges_, iterations);
+	logOptimizerStatistics(" (background)", background_optimizer_, chi2_before, currentIt);
+
+	PoseBuffer* poses = new PoseBuffer();
+	poses->generation = background_generation_;
+	for (unsigned int i = 0; i < background_optimizer_->vertices().size(); ++i) {
+	    poses->poses.push_back(background_optimizer_->vertex(i)->transformation);
+	}
+	{
+	    QMutexLocker locker(&pose_mutex_);
+	    poses->optimization = ++optimizations_;
+	}
+	publishPoses(poses);
+	Q_EMIT updateTransforms(getAllPosesAsMatrixList());
+	ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", __FUNCTION__ << " runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
+    }
+}
+
 void GraphManager::broadcastTransform(const ros::TimerEvent& ){
 
     tf::Transform cam2rgb;
     cam2rgb.setRotation(tf::createQuaternionFromRPY(-1.57,0,-1.57));
     cam2rgb.setOrigin(tf::Point(0,-0.04,0));
 
+    PoseBufferPtr poses = currentPoses();
+    if(poses && !poses->poses.empty())
+	kinect_transform_ = hogman2TF(poses->poses.back());
 
     world2cam_ = cam2rgb*kinect_transform_;
     //printTransform("kinect", kinect_transform_);
@@ -831,6 +1103,64 @@ void GraphManager::reset(){
     reset_request_ = true;
 }
 
+void GraphManager::addToMapIndex(const Node* node){
+    std::clock_t starttime=std::clock();
+    const int step = global_map_index_step;
+    AIS::PoseGraph3D::Vertex* v = optimizer_->vertex(node->id_);
+    if(step <= 0 || !v) return;
+
+    _Matrix< 4, 4, double > m = v->transformation.toMatrix();
+    const pointcloud_type& pc = node->pc_col;
+    //subsample the raster in both directions (unorganized clouds are treated as a single row)
+    const int width = pc.height > 1 ? (int)pc.width : (int)pc.points.size();
+    const int height = pc.height > 1 ? (int)pc.height : 1;
+    std::vector<float> coords;
+    coords.reserve(3 * (width/step + 1) * (height/step + 1));
+    for(int y = 0; y < height; y += step){
+      for(int x = 0; x < width; x += step){
+        const point_type& p = pc.points[y*width + x];
+        if(pcl_isnan(p.x) || pcl_isnan(p.y) || pcl_isnan(p.z)) continue;
+        if(Max_Depth >= 0 && p.x*p.x + p.y*p.y + p.z*p.z > Max_Depth*Max_Depth) continue;
+        for(int r = 0; r < 3; r++){
+          coords.push_back(m[r][0]*p.x + m[r][1]*p.y + m[r][2]*p.z + m[r][3]);
+        }
+      }
+    }
+    map_index_.Insert(node->id_, coords.empty() ? NULL : &coords[0], coords.size()/3);
+    map_index_poses_[node->id_] = v->transformation;
+    ROS_DEBUG("Map index: %d points in %d trees", map_index_.NumPoints(), map_index_.NumTrees());
+    ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", __FUNCTION__ << " runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
+}
+
+const dgc::gicp::KDForest<3, float>& GraphManager::mapIndex(){
+    updateMapIndex();
+    return map_index_;
+}
+
+void GraphManager::updateMapIndex(){
+    std::clock_t starttime=std::clock();
+    const double tolerance = global_map_index_tolerance;
+    std::vector<int> moved;
+    for(std::map<int, Transformation3>::const_iterator it = map_index_poses_.begin(); it != map_index_poses_.end(); ++it){
+      AIS::PoseGraph3D::Vertex* v = optimizer_->vertex(it->first);
+      if(!v) continue;
+      Transformation3 motion = it->second.inverse() * v->transformation;
+      double dist = sqrt(motion.translation().x()*motion.translation().x() + 
+                         motion.translation().y()*motion.translation().y() + 
+                         motion.translation().z()*motion.translation().z());
+      double angle = 2.0 * acos(std::min(1.0, std::fabs((double)motion.rotation().w())));
+      if(dist > tolerance || angle > tolerance) moved.push_back(it->first);
+    }
+    if(moved.empty()) return;
+
+    map_index_.Remove(moved); //at once, so every tree is rebuilt only once
+    for(unsigned int i = 0; i < moved.size(); i++){
+      addToMapIndex(graph_[moved[i]]);
+    }
+    ROS_INFO("Reinserted %d of %d nodes into the map index", (int)moved.size(), (int)map_index_poses_.size());
+    ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", __FUNCTION__ << " runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
+}
+
 void GraphManager::deleteLastFrame(){
     if(graph_.size() <= 1) {
       ROS_INFO("Resetting, as the only node is to be deleted");
@@ -848,7 +1178,19 @@ void GraphManager::deleteLastFrame(){
 	  optimizer_->removeEdge((*edge_iter));
     }
 
+    for(std::vector<AIS::LoadedEdge3D>::iterator it = edges_.begin(); it != edges_.end(); ){
+	if(it->id1 == v_to_del->id() || it->id2 == v_to_del->id()) it = edges_.erase(it);
+	else ++it;
+    }
     optimizer_->removeVertex(v_to_del);
+    map_index_.Remove(graph_.size()-1);
+    map_index_poses_.erase(graph_.size()-1);
+    edges_sent_ = 0; //the background optimizer starts over
+    full_optimization_pending_ = true;
+    {
+      QMutexLocker locker(&pose_mutex_);
+      graph_generation_++;
+    }
     graph_.erase(graph_.size()-1);
     optimizeGraph();//s.t. the effect of the removed edge transforms are removed to
     ROS_INFO("Removed most recent node");
@@ -863,17 +1205,14 @@ QList<QMatrix4x4>* GraphManager::getAllPosesAsMatrixList(){
     std::clock_t starttime=std::clock();
     ROS_DEBUG("Retrieving all transformations from optimizer");
     QList<QMatrix4x4>* result = new QList<QMatrix4x4>();
+    PoseBufferPtr poses = currentPoses();
+    if(!poses) return result;
 #if defined(QT_VERSION) && QT_VERSION >= 0x040700
-    result->reserve(optimizer_->vertices().size());//only allocates the internal pointer array
+    result->reserve(poses->poses.size());//only allocates the internal pointer array
 #endif
 
-    for (unsigned int i = 0; i < optimizer_->vertices().size(); ++i) {
-	AIS::PoseGraph3D::Vertex* v = optimizer_->vertex(i);
-	if(v){ 
-	    result->push_back(hogman2QMatrix(v->transformation)); 
-	} else {
-	    ROS_ERROR("Nullpointer in graph at position %i!", i);
-	}
+    for (unsigned int i = 0; i < poses->poses.size(); ++i) {
+	result->push_back(hogman2QMatrix(poses->poses[i])); 
     }
     ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "function runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec"); 
     return result;
@@ -908,19 +1247,16 @@ void GraphManager::saveAllCloudsToFile(QString filename){
     //fill message
     //rgbdslam::CloudTransforms msg;
     QString message;
-    for (unsigned int i = 0; i < optimizer_->vertices().size(); ++i) {
-	AIS::PoseGraph3D::Vertex* v = optimizer_->vertex(i);
-	if(!v){ 
-	    ROS_ERROR("Nullpointer in graph at position %i!", i);
-	    continue;
-	}
-	tf::Transform transform = hogman2TF(v->transformation);
+    PoseBufferPtr poses = currentPoses(); //runs in the background, so use a fixed set of poses
+    unsigned int num_poses = poses ? std::min(poses->poses.size(), graph_.size()) : 0;
+    for (unsigned int i = 0; i < num_poses; ++i) {
+	tf::Transform transform = hogman2TF(poses->poses[i]);
 	tf::Transform cam2rgb;
 	cam2rgb.setRotation(tf::createQuaternionFromRPY(-1.57,0,-1.57));
 	cam2rgb.setOrigin(tf::Point(0,-0.04,0));
 	world2cam = cam2rgb*transform;
 	transformAndAppendPointCloud (graph_[i]->pc_col, aggregate_cloud, world2cam, Max_Depth);
-	Q_EMIT setGUIStatus(message.sprintf("Saving to %s: Transformed Node %i/%i", qPrintable(filename), i, (int)optimizer_->vertices().size()));
+	Q_EMIT setGUIStatus(message.sprintf("Saving to %s: Transformed Node %i/%i", qPrintable(filename), i, (int)num_poses));
     }
     aggregate_cloud.header.frame_id = "/openni_camera";
     if(filename.endsWith(".pcd", Qt::CaseInsensitive))
@@ -978,13 +1314,10 @@ void GraphManager::sendAllClouds(){
     tf::Transform  world2cam;
     //fill message
     //rgbdslam::CloudTransforms msg;
-    for (unsigned int i = 0; i < optimizer_->vertices().size(); ++i) {
-	AIS::PoseGraph3D::Vertex* v = optimizer_->vertex(i);
-	if(!v){ 
-	    ROS_ERROR("Nullpointer in graph at position %i!", i);
-	    continue;
-	}
-	tf::Transform transform = hogman2TF(v->transformation);
+    PoseBufferPtr poses = currentPoses();
+    unsigned int num_poses = poses ? std::min(poses->poses.size(), graph_.size()) : 0;
+    for (unsigned int i = 0; i < num_poses; ++i) {
+	tf::Transform transform = hogman2TF(poses->poses[i]);
 
 	tf::Transform cam2rgb;
 	cam2rgb.setRotation(tf::createQuaternionFromRPY(-1.57,0,-1.57));
@@ -45,14 +45,34 @@
 #include <string>
 #include <ctime>
 #include <memory> //for auto_ptr
+#include <QMutex>
+#include <QFuture>
+#include <boost/shared_ptr.hpp>
 #include "glviewer.h"
 #include "globaldefinitions.h"
+#include "../gicp/kdtree_forest.h"
 
 //#define ROSCONSOLE_SEVERITY_INFO
 
 namespace AIS = AISNavigation;
 
 //!Computes a globally optimal trajectory from transformations between Node-pairs
+///Poses of all vertices (indexed by id), published for readers in other threads
+///(see GraphManager::currentPoses). A buffer is never modified after publication
+struct PoseBuffer {
+  std::vector<Transformation3> poses;
+  unsigned int generation;   ///< of the graph, increased whenever vertices are removed
+  unsigned int optimization; ///< number of the optimizer run the poses are based on
+};
+typedef boost::shared_ptr<const PoseBuffer> PoseBufferPtr;
+
+///What the background optimizer needs to catch up with the graph
+struct OptimizerRequest {
+  unsigned int generation;
+  std::vector<Transformation3> poses;   ///< current estimates of all vertices
+  std::vector<AIS::LoadedEdge3D> edges; ///< edges not yet sent in this generation
+};
+
 class GraphManager : public QObject {
     Q_OBJECT
     Q_SIGNALS:
@@ -110,6 +130,12 @@ class GraphManager : public QObject {
     
     void flannNeighbours();
 
+    ///Spatial index of the (subsampled) points of all nodes in the frame of the first node,
+    ///e.g. for ICP against the map. Search results identify the node by its id.
+    ///Nodes that optimizations moved by more than global_map_index_tolerance are reinserted
+    ///here, i.e. on demand, so that the optimization itself stays independent of the map size
+    const dgc::gicp::KDForest<3, float>& mapIndex();
+
     float Max_Depth;
     //void setMaxDepth(float max_depth);
 protected:
@@ -128,6 +154,10 @@ protected:
     
     std::vector<int> getPotentialEdgeTargetsFeatures(const Node* new_node, int max_targets);
     
+    ///Optimize the graph and publish the poses. With global_concurrent_optimization, 
+    ///only hand the graph to the background optimizer and adopt its latest results.
+    ///With global_incremental_optimization, optimize only after loop closures, removals
+    ///or if chi2 grew by more than global_optimizer_chi2_threshold
     void optimizeGraph();
     void initializeHogman();
     bool addEdgeToHogman(AIS::LoadedEdge3D edge, bool good_edge);
@@ -157,10 +187,61 @@ protected:
 
 
     void mergeAllClouds(pointcloud_type & merge);
+    ///Insert the points of the node, transformed with the current estimate of its pose, into map_index_
+    void addToMapIndex(const Node* node);
+    ///Reinsert the nodes into map_index_ whose pose changed since they were inserted
+    void updateMapIndex();
     
     
     AIS::GraphOptimizer3D* optimizer_;
 
+    ///The published poses, safe to use from any thread
+    PoseBufferPtr currentPoses() const;
+    ///Make poses the current PoseBuffer (takes ownership). If the current buffer is
+    ///from a later optimizer run, that one is kept instead. Either way, vertices that 
+    ///only one of them knows are appended, moved along with the last common vertex
+    void publishPoses(PoseBuffer* poses);
+    ///Log chi2 before and after an optimizer run and the number of iterations, 
+    ///also accumulated over all runs (on the "statistics" logger, for benchmarks)
+    void logOptimizerStatistics(const char* which, AIS::GraphOptimizer3D* optimizer, double chi2_before, int iterations);
+    ///Optimize the vertices of optimizer with the backend selected by global_optimizer_backend.
+    ///edges are those of optimizer, for the backends that only use its vertices.
+    ///Returns the number of iterations
+    int runOptimizer(AIS::GraphOptimizer3D* optimizer, const std::vector<AIS::LoadedEdge3D>& edges, int iterations);
+    ///Write the graph to global_pose_graph_file (if set), e.g. to benchmark the backends
+    void savePoseGraph();
+    ///Publish the current poses of optimizer_
+    void publishOptimizerPoses();
+    ///Set the vertices of optimizer_ to the latest results of the background optimizer
+    void adoptOptimizedPoses();
+    ///Pass the new part of the graph to the background optimizer, start it if idle.
+    ///Requests made while it is busy are merged
+    void requestOptimization();
+    ///Body of the background optimizer thread, runs until no request is pending
+    void optimizerLoop();
+
+    std::vector<AIS::LoadedEdge3D> edges_; ///<all edges in optimizer_, for the background optimizer
+    unsigned int edges_sent_;        ///<edges_ up to here were passed to the background optimizer
+    unsigned int graph_generation_;  ///<increased whenever vertices are removed (guarded by pose_mutex_)
+    unsigned int adopted_optimization_; ///<optimizer run the poses of optimizer_ are based on
+    unsigned int optimizations_;     ///<number of optimizer runs (guarded by pose_mutex_)
+    mutable QMutex pose_mutex_;
+    PoseBufferPtr poses_;            ///<guarded by pose_mutex_
+    QMutex request_mutex_;
+    OptimizerRequest* pending_request_; ///<guarded by request_mutex_
+    bool optimizer_thread_runs_;     ///<guarded by request_mutex_
+    QFuture<void> optimizer_thread_;
+    AIS::GraphOptimizer3D* background_optimizer_; ///<only used by optimizerLoop
+    std::vector<AIS::LoadedEdge3D> background_edges_; ///<all edges in background_optimizer_
+    unsigned int background_generation_;
+
+    bool full_optimization_pending_; ///<a loop was closed or vertices were removed since the last optimization
+    double chi2_after_optimization_; ///<of optimizer_, after the last optimization (or its request, or adoption of its results)
+    unsigned int optimizer_runs_;       ///<since startup (guarded by pose_mutex_)
+    unsigned int optimizer_iterations_; ///<in all optimizer runs (guarded by pose_mutex_)
+    dgc::gicp::KDForest<3, float> map_index_;
+    std::map<int, Transformation3> map_index_poses_; ///<pose with which each node is in map_index_
+
     ros::Publisher marker_pub_; 
     //ros::Publisher transform_pub_;
     ros::Publisher ransac_marker_pub_;
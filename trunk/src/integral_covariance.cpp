@@ -0,0 +1,148 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "integral_covariance.h"
+#include <Eigen/Eigenvalues>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <ros/ros.h>
+
+IntegralCovarianceEstimator::IntegralCovarianceEstimator(int window_radius, float max_depth_change_factor)
+: cloud_(NULL), width_(0), height_(0),
+  window_radius_(window_radius),
+  max_depth_change_factor_(max_depth_change_factor)
+{}
+
+void IntegralCovarianceEstimator::setInputCloud(const pointcloud_type& cloud){
+  std::clock_t starttime=std::clock();
+  ROS_ERROR_COND(cloud.height <= 1, "IntegralCovarianceEstimator needs an organized point cloud");
+
+  cloud_ = &cloud;
+  width_ = cloud.width;
+  height_ = cloud.height;
+  const int stride = width_ + 1;
+  IntegralEntry zero = {0,0,0,0,0,0,0,0,0,0};
+  integral_.assign(stride * (height_ + 1), zero);
+
+  for (int v = 0; v < height_; v++){
+    IntegralEntry row = zero; //sums of the current row up to u
+    for (int u = 0; u < width_; u++){
+      const point_type& p = cloud.points[v * width_ + u];
+      if (!(std::isnan(p.x) || std::isnan(p.y) || std::isnan(p.z))){
+        row.count += 1;
+        row.x += p.x;  row.y += p.y;  row.z += p.z;
+        row.xx += p.x*p.x;  row.xy += p.x*p.y;  row.xz += p.x*p.z;
+        row.yy += p.y*p.y;  row.yz += p.y*p.z;  row.zz += p.z*p.z;
+      }
+      const IntegralEntry& above = integral_[v * stride + u + 1];
+      IntegralEntry& e = integral_[(v + 1) * stride + u + 1];
+      e.count = above.count + row.count;
+      e.x = above.x + row.x;  e.y = above.y + row.y;  e.z = above.z + row.z;
+      e.xx = above.xx + row.xx;  e.xy = above.xy + row.xy;  e.xz = above.xz + row.xz;
+      e.yy = above.yy + row.yy;  e.yz = above.yz + row.yz;  e.zz = above.zz + row.zz;
+    }
+  }
+  ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "integral image runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
+}
+
+void IntegralCovarianceEstimator::windowSum(int u0, int v0, int u1, int v1, IntegralEntry& sum) const{
+  const int stride = width_ + 1;
+  const IntegralEntry& a = integral_[v0 * stride + u0];           //above left
+  const IntegralEntry& b = integral_[v0 * stride + u1 + 1];       //above right
+  const IntegralEntry& c = integral_[(v1 + 1) * stride + u0];     //below left
+  const IntegralEntry& d = integral_[(v1 + 1) * stride + u1 + 1]; //below right
+  sum.count = d.count - b.count - c.count + a.count;
+  sum.x  = d.x  - b.x  - c.x  + a.x;
+  sum.y  = d.y  - b.y  - c.y  + a.y;
+  sum.z  = d.z  - b.z  - c.z  + a.z;
+  sum.xx = d.xx - b.xx - c.xx + a.xx;
+  sum.xy = d.xy - b.xy - c.xy + a.xy;
+  sum.xz = d.xz - b.xz - c.xz + a.xz;
+  sum.yy = d.yy - b.yy - c.yy + a.yy;
+  sum.yz = d.yz - b.yz - c.yz + a.yz;
+  sum.zz = d.zz - b.zz - c.zz + a.zz;
+}
+
+int IntegralCovarianceEstimator::consistentRadius(int u, int v) const{
+  const float z_c = cloud_->points[v * width_ + u].z;
+  // check the corners and edge centers of the window
+  static const int offsets[8][2] = {{-1,-1},{0,-1},{1,-1},{-1,0},{1,0},{-1,1},{0,1},{1,1}};
+  for (int r = window_radius_; r >= 1; r--){
+    const float max_change = max_depth_change_factor_ * z_c * r;
+    bool consistent = true;
+    for (int i = 0; i < 8 && consistent; i++){
+      int su = std::min(std::max(u + offsets[i][0]*r, 0), width_-1);
+      int sv = std::min(std::max(v + offsets[i][1]*r, 0), height_-1);
+      float z = cloud_->points[sv * width_ + su].z;
+      consistent = std::isnan(z) || std::fabs(z - z_c) <= max_change;
+    }
+    if (consistent) return r;
+  }
+  return 0;
+}
+
+bool IntegralCovarianceEstimator::computeCovariance(int u, int v, Eigen::Vector3d& mean, Eigen::Matrix3d& covariance) const{
+  if (cloud_ == NULL || u < 0 || v < 0 || u >= width_ || v >= height_) return false;
+  if (std::isnan(cloud_->points[v * width_ + u].z)) return false;
+
+  int r = consistentRadius(u, v);
+  if (r == 0) return false;
+
+  IntegralEntry s;
+  windowSum(std::max(u - r, 0), std::max(v - r, 0), std::min(u + r, width_-1), std::min(v + r, height_-1), s);
+  const double min_count = std::max(3, (2*r+1)*(2*r+1)/3);
+  if (s.count < min_count) return false;
+
+  mean = Eigen::Vector3d(s.x, s.y, s.z) / s.count;
+  covariance << s.xx, s.xy, s.xz,
+                s.xy, s.yy, s.yz,
+                s.xz, s.yz, s.zz;
+  covariance /= s.count;
+  covariance -= mean * mean.transpose();
+  return true;
+}
+
+bool IntegralCovarianceEstimator::computeNormal(int u, int v, Eigen::Vector3f& normal) const{
+  Eigen::Vector3d mean;
+  Eigen::Matrix3d covariance;
+  if (!computeCovariance(u, v, mean, covariance)) return false;
+
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(covariance); //eigenvalues in increasing order
+  Eigen::Vector3d n = solver.eigenvectors().col(0);
+  if (n.dot(mean) > 0) n = -n; //camera is at the origin
+  normal = n.cast<float>();
+  return true;
+}
+
+bool IntegralCovarianceEstimator::computeGICPCovariance(int u, int v, double epsilon, float covariance[6]) const{
+  Eigen::Vector3f n;
+  if (!computeNormal(u, v, n)) return false;
+  normalToGICPCovariance(n, epsilon, covariance);
+  return true;
+}
+
+void IntegralCovarianceEstimator::normalToGICPCovariance(const Eigen::Vector3f& n, double epsilon, float covariance[6]){
+  // I - (1-epsilon)*n*n^T equals diag(1,1,epsilon) in the eigenbasis
+  const float s = 1.0 - epsilon;
+  covariance[0] = 1.0 - s*n[0]*n[0];
+  covariance[1] =     - s*n[0]*n[1];
+  covariance[2] =     - s*n[0]*n[2];
+  covariance[3] = 1.0 - s*n[1]*n[1];
+  covariance[4] =     - s*n[1]*n[2];
+  covariance[5] = 1.0 - s*n[2]*n[2];
+}
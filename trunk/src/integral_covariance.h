@@ -0,0 +1,75 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef INTEGRAL_COVARIANCE_H
+#define INTEGRAL_COVARIANCE_H
+
+#include "globaldefinitions.h"
+#include <Eigen/Core>
+#include <vector>
+
+//!Local covariances of an organized point cloud from integral images
+/** For kinect clouds the 3D neighbours of a point are its neighbours in the
+ * image. Summed area tables of the coordinates and their products give the
+ * mean and covariance of any pixel window in constant time, i.e. no kd-tree
+ * and no nearest neighbour search is needed.
+ * Windows that reach over a depth discontinuity are shrunk until they only
+ * cover the surface of the center pixel.
+ */
+class IntegralCovarianceEstimator {
+public:
+  ///window_radius: half size of the pixel window (i.e. 2r+1 x 2r+1 pixels)
+  ///max_depth_change_factor: a window ends at a depth jump larger than factor*depth*radius (in m)
+  IntegralCovarianceEstimator(int window_radius = 4, float max_depth_change_factor = 0.01);
+
+  ///Build the integral images. The cloud needs to be organized (height > 1) and must
+  ///outlive the estimator. NaN points are ignored
+  void setInputCloud(const pointcloud_type& cloud);
+
+  ///Mean and covariance of the valid points in the window around pixel (u,v).
+  ///Returns false for invalid center points or too few valid neighbours
+  bool computeCovariance(int u, int v, Eigen::Vector3d& mean, Eigen::Matrix3d& covariance) const;
+
+  ///Surface normal at pixel (u,v), i.e., the eigenvector of the smallest eigenvalue of the
+  ///covariance, oriented towards the camera
+  bool computeNormal(int u, int v, Eigen::Vector3f& normal) const;
+
+  ///Regularized covariance as used by generalized ICP: Variance epsilon along the normal and
+  ///one along the surface. Stored as (xx, xy, xz, yy, yz, zz), like dgc::gicp::gicp_cov_t
+  bool computeGICPCovariance(int u, int v, double epsilon, float covariance[6]) const;
+
+  ///The regularized GICP covariance for a given (unit) normal
+  static void normalToGICPCovariance(const Eigen::Vector3f& normal, double epsilon, float covariance[6]);
+
+private:
+  ///Sums over all pixels above and left of a position
+  struct IntegralEntry {
+    double count, x, y, z, xx, xy, xz, yy, yz, zz;
+  };
+  ///Sums over the pixel rectangle [u0,u1] x [v0,v1] (inclusive)
+  void windowSum(int u0, int v0, int u1, int v1, IntegralEntry& sum) const;
+  ///Largest radius (at most window_radius_) for which the window does not cross a depth jump
+  int consistentRadius(int u, int v) const;
+
+  const pointcloud_type* cloud_;
+  int width_, height_;
+  int window_radius_;
+  float max_depth_change_factor_;
+  std::vector<IntegralEntry> integral_; ///< (width+1) x (height+1), first row/column zero
+};
+
+#endif
@@ -0,0 +1,120 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MINIMAL_SOLVER_H
+#define MINIMAL_SOLVER_H
+
+#include <Eigen/Core>
+#include <Eigen/SVD>
+#include <Eigen/Geometry>
+#include <cmath>
+
+//!Closed form rigid transformation for a RANSAC sample of N correspondences
+/** Horn/Umeyama alignment: The rotation is taken from the SVD of the
+ * 3x3 cross covariance of the centered points. Everything is fixed size,
+ * i.e. no heap allocations happen, which makes a hypothesis cost only a
+ * few hundred nanoseconds (compared to the std::vector/std::set based
+ * pcl::TransformationFromCorrespondences in Node::getTransformFromMatches).
+ */
+template <int N>
+class MinimalPoseSolver {
+public:
+  ///Draw N pairwise different indices from [0, range) with the given engine
+  ///Returns false if range is too small
+  template <class Engine>
+  static bool drawSample(Engine& rng, unsigned int range, unsigned int (&ids)[N]) {
+    if (range < (unsigned int) N) return false;
+    for (int i = 0; i < N; i++) {
+      bool duplicate;
+      do { //Redraw until the index is new. N is small, so linear search is fine
+        ids[i] = rng() % range;
+        duplicate = false;
+        for (int j = 0; j < i; j++)
+          duplicate |= (ids[j] == ids[i]);
+      } while (duplicate);
+    }
+    return true;
+  }
+
+  ///Distances between points are preserved by rigid motions. Check the
+  ///cyclic neighbours of the sample for consistency
+  static bool distancesConsistent(const Eigen::Vector3f (&from)[N],
+                                  const Eigen::Vector3f (&to)[N],
+                                  float max_dist_m) {
+    for (int i = 0; i < N; i++) {
+      float d_f = (from[(i+1)%N] - from[i]).norm();
+      float d_t = (to[(i+1)%N] - to[i]).norm();
+      if (std::fabs(d_f - d_t) > max_dist_m) return false;
+    }
+    return true;
+  }
+
+  ///A sample is degenerate if its points are (almost) collinear, as the rotation
+  ///about that line is then undetermined. min_area is the minimal area of the
+  ///parallelogram spanned by the sample points (in squared meters)
+  static bool isDegenerate(const Eigen::Vector3f (&pts)[N], float min_area) {
+    //Take the point farthest from the first as second base point...
+    int far = 1;
+    float far_dist = 0.0;
+    for (int i = 1; i < N; i++) {
+      float d = (pts[i] - pts[0]).squaredNorm();
+      if (d > far_dist) { far_dist = d; far = i; }
+    }
+    if (far_dist < min_area) return true; //all points coincide
+    //...and look for the largest area spanned with any third point
+    Eigen::Vector3f base = pts[far] - pts[0];
+    for (int i = 1; i < N; i++) {
+      if (base.cross(pts[i] - pts[0]).norm() >= min_area) return false;
+    }
+    return true;
+  }
+
+  ///Compute the transformation that maps from onto to (least squares).
+  ///Returns false for degenerate samples
+  static bool solve(const Eigen::Vector3f (&from)[N],
+                    const Eigen::Vector3f (&to)[N],
+                    Eigen::Matrix4f& transformation,
+                    float min_area = 1e-4) {
+    if (isDegenerate(from, min_area) || isDegenerate(to, min_area)) return false;
+
+    Eigen::Vector3f mean_from = Eigen::Vector3f::Zero(), mean_to = Eigen::Vector3f::Zero();
+    for (int i = 0; i < N; i++) {
+      mean_from += from[i];
+      mean_to   += to[i];
+    }
+    mean_from /= (float) N;
+    mean_to   /= (float) N;
+
+    Eigen::Matrix3f cross_cov = Eigen::Matrix3f::Zero();
+    for (int i = 0; i < N; i++)
+      cross_cov += (to[i] - mean_to) * (from[i] - mean_from).transpose();
+
+    Eigen::JacobiSVD<Eigen::Matrix3f> svd(cross_cov, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Matrix3f u = svd.matrixU();
+    const Eigen::Matrix3f& v = svd.matrixV();
+    if (u.determinant() * v.determinant() < 0) //avoid reflections
+      u.col(2) *= -1.0;
+    Eigen::Matrix3f rotation = u * v.transpose();
+
+    transformation.setIdentity();
+    transformation.block<3,3>(0,0) = rotation;
+    transformation.block<3,1>(0,3) = mean_to - rotation * mean_from;
+    return true;
+  }
+};
+
+#endif
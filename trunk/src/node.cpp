@@ -16,15 +16,21 @@
 
 
 #include "node.h"
+#include "minimal_solver.h"
+#include "integral_covariance.h"
 #include <cmath>
 #include <ctime>
 #include <Eigen/Geometry>
+#include <Eigen/LU>
+#include <Eigen/Cholesky>
 #include "pcl/ros/conversions.h"
 #include "pcl/point_types.h"
 #include <pcl/common/transformation_from_correspondences.h>
 #include <opencv2/highgui/highgui.hpp>
 #include <qtconcurrentrun.h>
 #include <QtConcurrentMap> 
+#include <boost/bind.hpp>
+#include <boost/random/mersenne_twister.hpp>
 
 #ifdef USE_SIFT_GPU
 #include "sift_gpu_feature_detector.h"
@@ -32,6 +38,9 @@
 
 //#include <math.h>
 #include <fstream>
+#include <map>
+#include <algorithm>
+#include <limits>
 #ifdef USE_ICP_BIN
 #include "gicp-fallback.h"
 #endif
@@ -69,7 +78,9 @@ flannIndex(NULL),
 matcher_(matcher)
 {
 #ifdef USE_ICP_CODE
+  gicp_point_set = NULL;
   gicp_initialized = false;
+  gicp_started_ = false;
 #endif
   std::clock_t starttime=std::clock();
 
@@ -115,12 +126,8 @@ matcher_(matcher)
   projectTo3D(feature_locations_2d_, feature_locations_3d_, pc_col); //takes less than 0.01 sec
 #endif
 
-  // projectTo3d need a dense cloud to use the points.at(px.x,px.y)-Call
-#ifdef USE_ICP_CODE
-  std::clock_t starttime4=std::clock();
-  createGICPStructures(); 
-  ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime4) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "gicp runtime: " << ( std::clock() - starttime4 ) / (double)CLOCKS_PER_SEC );
-#endif
+  // The GICP structures and dense normals are not built here, but only for accepted nodes 
+  // (see startGICPStructures and computeDenseNormals)
 
   std::clock_t starttime2=std::clock();
 #ifndef USE_SIFT_GPU
@@ -141,6 +148,11 @@ matcher_(matcher)
 Node::~Node(){
   if(flannIndex)
     delete flannIndex;
+#ifdef USE_ICP_CODE
+  gicp_future_.waitForFinished(); //the background build must not outlive the node
+  for (unsigned int i = 0; i < gicp_pyramid_.size(); i++)
+    delete gicp_pyramid_[i];
+#endif
 }
 
 void Node::publish(const char* frame, ros::Time timestamp){
@@ -173,10 +185,25 @@ bool Node::getRelativeTransformationTo_ICP_code(const Node* target_node,Eigen::M
   dgc_transform_t final_trafo;
   dgc_transform_identity(final_trafo);
 
-
+  // target_node was accepted before, so its structures are cached (or still being built)
+  startGICPStructures();
+  this->waitForGICPStructures();
+  target_node->waitForGICPStructures();
   assert(gicp_initialized && target_node->gicp_initialized);
 
-  unsigned int iterations = target_node->gicp_point_set->AlignScan(this->gicp_point_set, initial, final_trafo, gicp_d_max);
+  // coarse to fine: most iterations run on the small coarse levels, the finer 
+  // levels start from their result with a smaller correspondence distance
+  const int min_points = 50;
+  unsigned int iterations = 0;
+  double d_max = gicp_d_max;
+  for (unsigned int level = 0; level < gicp_pyramid_.size(); level++, d_max /= 2){
+    dgc::gicp::GICPPointSet* target_set = target_node->gicp_pyramid_[level];
+    dgc::gicp::GICPPointSet* source_set = this->gicp_pyramid_[level];
+    if (target_set->Size() < min_points || source_set->Size() < min_points) continue;
+    iterations = target_set->AlignScan(source_set, initial, final_trafo, d_max);
+    ROS_DEBUG("GICP level %u (%i and %i points, d_max %.3f): %u iterations", 
+        level, source_set->Size(), target_set->Size(), d_max, iterations);
+  }
 
 
   GICP2Eigen(final_trafo,transformation);
@@ -187,6 +214,34 @@ bool Node::getRelativeTransformationTo_ICP_code(const Node* target_node,Eigen::M
 
 }
 
+bool Node::refineEdgeICP_code(const Node* older_node, MatchingResult& mr){
+  Eigen::Matrix4f initial = mr.final_trafo;
+  if (!getRelativeTransformationTo_ICP_code(older_node, mr.icp_trafo, &initial)){
+    ROS_INFO("GICP between %i and %i did not converge. Keeping the feature based transformation", this->id_, older_node->id_);
+    return false;
+  }
+  Eigen::Matrix4f refined = mr.icp_trafo * initial; //GICP applies its result after the initial transformation
+
+  // check if icp improves alignment (as with USE_ICP_BIN)
+  vector<double> errors;
+  double error;
+  std::vector<cv::DMatch> inliers;
+  computeInliersAndError(mr.inlier_matches, refined,
+      this->feature_locations_3d_, older_node->feature_locations_3d_,
+      inliers, error, errors, 0.04*0.04); 
+  if (inliers.empty() || error > mr.rmse + 0.02){
+    ROS_INFO("GICP disagrees with the features (error %f, was %f). Keeping the feature based transformation", error, mr.rmse);
+    return false;
+  }
+
+  mr.final_trafo = refined;
+  mr.inlier_matches = inliers;
+  mr.rmse = error;
+  mr.edge.mean = eigen2Hogman(mr.final_trafo);
+  mr.edge.informationMatrix = computeInformationMatrix(older_node, mr.inlier_matches, mr.final_trafo);
+  return true;
+}
+
 # endif
 
 #ifdef USE_ICP_BIN
@@ -196,15 +251,19 @@ bool Node::getRelativeTransformationTo_ICP_bin(const Node* target_node,
   std::clock_t starttime_icp = std::clock();
 
   bool converged;
+  GICPResult gicp_result;
 
   if (initial_transformation != NULL)
   {
     pointcloud_type pc2;
     pcl::transformPointCloud(pc_col,pc2,*initial_transformation);
-    converged = gicpfallback(pc2,target_node->pc_col, transformation);
+    converged = gicpfallback(pc2,target_node->pc_col, transformation, &gicp_result);
   }
   else {
-    converged = gicpfallback(pc_col,target_node->pc_col, transformation); }
+    converged = gicpfallback(pc_col,target_node->pc_col, transformation, &gicp_result); }
+
+  ROS_INFO("GICP between %i and %i: %i iterations, %i correspondences, residual: %.2f cm%s", this->id_, target_node->id_,
+           gicp_result.iterations, gicp_result.matches, gicp_result.residual*100, converged ? "" : " (not converged)");
 
   // Paper
   // ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime_icp) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "ICP runtime: " << ( std::clock() - starttime_icp ) / (double)CLOCKS_PER_SEC );
@@ -223,6 +282,119 @@ bool Node::getRelativeTransformationTo_ICP_bin(const Node* target_node,
 //#endif
 //#endif
 
+///Pinhole parameters of the kinect, scaled to the resolution of the cloud
+static void kinectIntrinsics(unsigned int width, unsigned int height, float& f, float& cx, float& cy){
+  f = Node::projective_icp_focal_length * width / Node::projective_icp_reference_width;
+  cx = (width - 1) / 2.0; //principal point at the image center
+  cy = (height - 1) / 2.0;
+}
+
+void Node::computeDenseNormals(){
+  dense_normals_.clear();
+  if (pc_col.height <= 1) return; //no image structure
+  std::clock_t starttime=std::clock();
+
+  IntegralCovarianceEstimator estimator;
+  estimator.setInputCloud(pc_col);
+  const int step = projective_icp_normal_step;
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  dense_normals_.reserve(((pc_col.width + step - 1) / step) * ((pc_col.height + step - 1) / step));
+  for (unsigned int v = 0; v < pc_col.height; v += step){
+    for (unsigned int u = 0; u < pc_col.width; u += step){
+      Eigen::Vector3f normal;
+      if (!estimator.computeNormal(u, v, normal))
+        normal = Eigen::Vector3f(nan, nan, nan);
+      dense_normals_.push_back(normal);
+    }
+  }
+  ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "dense normals runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
+}
+
+bool Node::refineTransformationProjectiveICP(const Node* target_node, Eigen::Matrix4f& transformation) const{
+  const pointcloud_type& target = target_node->pc_col;
+  if (pc_col.height <= 1 || target.height <= 1 || target_node->dense_normals_.empty()) 
+    return false;
+  std::clock_t starttime=std::clock();
+  typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+  typedef Eigen::Matrix<double, 6, 1> Vector6d;
+  const unsigned int min_associations = 500;
+  const double max_dist_squared = projective_icp_max_dist * projective_icp_max_dist;
+  const int step = projective_icp_normal_step;
+  const int normals_width = (target.width + step - 1) / step;
+  const int normals_height = (target.height + step - 1) / step;
+  float f, cx, cy;
+  kinectIntrinsics(target.width, target.height, f, cx, cy);
+
+  std::vector<Eigen::Vector3d> source;
+  source.reserve(pc_col.size() / (projective_icp_sample_step * projective_icp_sample_step));
+  for (unsigned int v = 0; v < pc_col.height; v += projective_icp_sample_step){
+    for (unsigned int u = 0; u < pc_col.width; u += projective_icp_sample_step){
+      const point_type& p = pc_col.points[v * pc_col.width + u];
+      if (!(isnan(p.x) || isnan(p.y) || isnan(p.z)))
+        source.push_back(Eigen::Vector3d(p.x, p.y, p.z));
+    }
+  }
+  if (source.size() < min_associations) return false;
+
+  Eigen::Matrix4d trafo = transformation.cast<double>();
+  unsigned int associations = 0, iteration = 0;
+  double rms_error = 0.0;
+  while (iteration < projective_icp_iterations){
+    iteration++;
+    const Eigen::Matrix3d rotation = trafo.block<3,3>(0,0);
+    const Eigen::Vector3d translation = trafo.block<3,1>(0,3);
+    Matrix6d JtJ = Matrix6d::Zero();
+    Vector6d Jtr = Vector6d::Zero();
+    double squared_error = 0.0;
+    associations = 0;
+    for (unsigned int i = 0; i < source.size(); i++){
+      const Eigen::Vector3d q = rotation * source[i] + translation;
+      if (!(q.z() > 0)) continue;
+      // projection into the target image, rounded to the grid of the cached normals
+      const int nu = (int) floor((f * q.x() / q.z() + cx) / step + 0.5);
+      const int nv = (int) floor((f * q.y() / q.z() + cy) / step + 0.5);
+      if (nu < 0 || nv < 0 || nu >= normals_width || nv >= normals_height) continue;
+      const Eigen::Vector3f& normal_f = target_node->dense_normals_[nv * normals_width + nu];
+      if (isnan(normal_f[0])) continue; //also no valid point
+      const point_type& p = target.points[nv * step * target.width + nu * step];
+      const Eigen::Vector3d difference = q - Eigen::Vector3d(p.x, p.y, p.z);
+      if (difference.squaredNorm() > max_dist_squared) continue;
+
+      // point-to-plane residual and its jacobian w.r.t. a motion (translation, small rotation)
+      // applied to the transformed point: d(n'(q-p)) = n'*dt + (q x n)'*dw
+      const Eigen::Vector3d normal = normal_f.cast<double>();
+      const double residual = normal.dot(difference);
+      Vector6d jacobian;
+      jacobian << normal, q.cross(normal);
+      JtJ += jacobian * jacobian.transpose();
+      Jtr += jacobian * residual;
+      squared_error += residual * residual;
+      associations++;
+    }
+    if (associations < min_associations){
+      ROS_INFO("Projective ICP between %i and %i: only %u associations", this->id_, target_node->id_, associations);
+      return false;
+    }
+    rms_error = sqrt(squared_error / associations);
+
+    const Vector6d delta = -JtJ.ldlt().solve(Jtr);
+    const Eigen::Vector3d rotation_vector = delta.tail<3>();
+    const double angle = rotation_vector.norm();
+    Eigen::Matrix4d motion = Eigen::Matrix4d::Identity();
+    if (angle > 0)
+      motion.block<3,3>(0,0) = Eigen::AngleAxisd(angle, rotation_vector / angle).toRotationMatrix();
+    motion.block<3,1>(0,3) = delta.head<3>();
+    trafo = motion * trafo;
+    if (delta.norm() < 1e-5) break; //converged
+  }
+  transformation = trafo.cast<float>();
+
+  ROS_INFO("Projective ICP between %i and %i: %u iterations, %u associations, rms point-to-plane error %f", 
+      this->id_, target_node->id_, iteration, associations, rms_error);
+  ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "projective icp runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
+  return true;
+}
+
 // build search structure for descriptor matching
 void Node::buildFlannIndex() {
   //std::clock_t starttime=std::clock();
@@ -234,54 +406,141 @@ void Node::buildFlannIndex() {
 
 
 #ifdef USE_ICP_CODE
-void Node::createGICPStructures(unsigned int max_count){
-
-  gicp_point_set = new dgc::gicp::GICPPointSet();
+///Accumulated points (and normals) of one voxel (helper for createGICPStructures)
+struct VoxelCell {
+  int ix, iy, iz; ///< integer voxel coordinates
+  unsigned int count;
+  Eigen::Vector3d point_sum;
+  Eigen::Vector3d normal_sum;
+  bool operator<(const VoxelCell& o) const {
+    if (ix != o.ix) return ix < o.ix;
+    if (iy != o.iy) return iy < o.iy;
+    return iz < o.iz;
+  }
+  bool sameVoxel(const VoxelCell& o) const { return ix == o.ix && iy == o.iy && iz == o.iz; }
+};
+
+///Sort the cells and merge cells of the same voxel
+static void mergeVoxelCells(std::vector<VoxelCell>& cells){
+  if (cells.empty()) return;
+  std::sort(cells.begin(), cells.end());
+  unsigned int last = 0;
+  for (unsigned int i = 1; i < cells.size(); i++){
+    if (cells[i].sameVoxel(cells[last])){
+      cells[last].count += cells[i].count;
+      cells[last].point_sum += cells[i].point_sum;
+      cells[last].normal_sum += cells[i].normal_sum;
+    } else {
+      cells[++last] = cells[i];
+    }
+  }
+  cells.resize(last + 1);
+}
 
+///Point set of the cell centroids. With use_normals, the covariances are given by the mean normal
+static dgc::gicp::GICPPointSet* voxelCellsToPointSet(const std::vector<VoxelCell>& cells, unsigned int max_count, 
+                                                     bool use_normals, double epsilon){
+  dgc::gicp::GICPPointSet* point_set = new dgc::gicp::GICPPointSet();
   dgc::gicp::GICPPoint g_p;
   g_p.range = -1;
-  for(int k = 0; k < 3; k++) {
-    for(int l = 0; l < 3; l++) {
-      g_p.C[k][l] = (k == l)?1:0;
-    }
-  }
+  dgc::gicp::cov_set_identity(g_p.C);
 
   int step = 1;
-  if (pc_col.points.size()>max_count)
-    step = ceil(pc_col.points.size()*1.0/max_count);
+  if (cells.size() > max_count)
+    step = ceil(cells.size()*1.0/max_count);
+  for (unsigned int i = 0; i < cells.size(); i += step){
+    const VoxelCell& cell = cells[i];
+    Eigen::Vector3d centroid = cell.point_sum / cell.count;
+    if (use_normals)
+      IntegralCovarianceEstimator::normalToGICPCovariance(cell.normal_sum.normalized().cast<float>(), epsilon, g_p.C);
+    g_p.x = centroid[0];
+    g_p.y = centroid[1];
+    g_p.z = centroid[2];
+    point_set->AppendPoint(g_p);
+  }
+  if (point_set->Size() == 0) return point_set; //not used for alignment
 
-  int cnt = 0;
+  point_set->SetDebug(false);
+  point_set->SetGICPEpsilon(epsilon);
+  point_set->BuildKDTree();
+  if (use_normals)
+    point_set->SetMatricesDone(true);
+  else
+    point_set->ComputeMatrices();
+  point_set->SetMaxIterationInner(8); // as in test_gicp->cpp
+  point_set->SetMaxIteration(Node::gicp_max_iterations);
+  return point_set;
+}
+
+void Node::createGICPStructures(unsigned int max_count){
+  std::clock_t starttime_gicp = std::clock();
+
+  // For organized clouds, the covariances are computed from the pixel neighbourhood
+  // of the full resolution cloud instead of the kd-tree of the subsampled points.
+  // A voxel gets the covariance of the mean normal of its points
+  bool organized = gicp_organized_covariances && pc_col.height > 1;
+  IntegralCovarianceEstimator covariance_estimator;
+  if (organized) covariance_estimator.setInputCloud(pc_col);
+
+  // finest level
+  std::vector<VoxelCell> cells;
+  cells.reserve(pc_col.points.size());
   for (unsigned int i=0; i<pc_col.points.size(); i++ ){
-    point_type  p = pc_col.points.at(i);
-    if (!(isnan(p.x) || isnan(p.y) || isnan(p.z))) {
-      // add points to pointset for icp
-      if (cnt++%step == 0){
-        g_p.x=p.x;
-        g_p.y=p.y;
-        g_p.z=p.z;
-        gicp_point_set->AppendPoint(g_p);
-      }
+    const point_type& p = pc_col.points[i];
+    if (isnan(p.x) || isnan(p.y) || isnan(p.z)) continue;
+    VoxelCell cell;
+    cell.normal_sum = Eigen::Vector3d::Zero();
+    if (organized){
+      Eigen::Vector3f normal;
+      if (!covariance_estimator.computeNormal(i % pc_col.width, i / pc_col.width, normal))
+        continue; //no consistent neighbourhood, e.g. at depth jumps
+      cell.normal_sum = normal.cast<double>();
+    }
+    cell.ix = (int) floor(p.x / gicp_finest_voxel_size);
+    cell.iy = (int) floor(p.y / gicp_finest_voxel_size);
+    cell.iz = (int) floor(p.z / gicp_finest_voxel_size);
+    cell.count = 1;
+    cell.point_sum = Eigen::Vector3d(p.x, p.y, p.z);
+    cells.push_back(cell);
+  }
+  mergeVoxelCells(cells);
+
+  // every coarser level merges 2x2x2 cells of the finer one
+  gicp_pyramid_.assign(gicp_pyramid_levels, NULL);
+  for (int level = gicp_pyramid_levels-1; level >= 0; level--){
+    gicp_pyramid_[level] = voxelCellsToPointSet(cells, max_count, organized, gicp_epsilon);
+    ROS_DEBUG("GICP pyramid level %i: %i points", level, gicp_pyramid_[level]->Size());
+    if (level == 0) break;
+    for (unsigned int i = 0; i < cells.size(); i++){
+      cells[i].ix >>= 1; //arithmetic shift, i.e. floor(ix/2)
+      cells[i].iy >>= 1;
+      cells[i].iz >>= 1;
     }
+    mergeVoxelCells(cells);
   }
+  gicp_point_set = gicp_pyramid_.back();
   ROS_WARN("gicp_point_set.Size() %i", gicp_point_set->Size() );
 
-
-  std::clock_t starttime_gicp = std::clock();
-  // build search structure for gicp:
-  gicp_point_set->SetDebug(false);
-  gicp_point_set->SetGICPEpsilon(gicp_epsilon);
-  gicp_point_set->BuildKDTree();
-  gicp_point_set->ComputeMatrices();
-  gicp_point_set->SetMaxIterationInner(8); // as in test_gicp->cpp
-  gicp_point_set->SetMaxIteration(gicp_max_iterations);
   ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime_gicp) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "function runtime to create gicp-Structures: "<< ( std::clock() - starttime_gicp ) / (double)CLOCKS_PER_SEC  <<"sec");
 
-  ROS_INFO_STREAM("time for creating the structure: " << ((std::clock()-starttime_gicp*1.0) / (double)CLOCKS_PER_SEC));
-  ROS_INFO_STREAM("current: " << std::clock() << " " << "start_time: " << starttime_gicp);
-
   gicp_initialized = true;
 
 }
+
+void Node::startGICPStructures(){
+  if (gicp_started_) return;
+  gicp_started_ = true;
+  const unsigned int max_count = gicp_point_cnt;
+  gicp_future_ = QtConcurrent::run(this, &Node::createGICPStructures, max_count);
+}
+
+void Node::waitForGICPStructures() const{
+  if (!gicp_started_)
+    ROS_ERROR("GICP structures of node %i are used before they were requested", this->id_);
+  std::clock_t starttime=std::clock();
+  gicp_future_.waitForFinished();
+  ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "waiting for gicp structures: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
+}
 #endif
 
 //TODO: This function seems to be resistant to paralellization probably due to knnSearch
@@ -436,6 +695,104 @@ void Node::projectTo3D(std::vector<cv::KeyPoint>& feature_locations_2d,
 
 
 
+void Node::filterConsistentMatches(const Node* earlier_node,
+    const std::vector<cv::DMatch>& matches,
+    float max_dist_m,
+    std::vector<cv::DMatch>& consistent_matches) const{
+
+  const unsigned int num_partners = 32;    // random partners per match to estimate its degree
+  const unsigned int max_candidates = 100; // clique candidates, in order of decreasing degree
+  const unsigned int num_seeds = 3;        // grow cliques from the vertices with the highest degree
+  const unsigned int n = matches.size();
+
+  consistent_matches.clear();
+  if (n == 0) return;
+
+  std::vector<Eigen::Vector3f> from(n), to(n);
+  for (unsigned int i = 0; i < n; i++){
+    const Eigen::Vector4f& f = this->feature_locations_3d_[matches[i].queryIdx];
+    const Eigen::Vector4f& t = earlier_node->feature_locations_3d_[matches[i].trainIdx];
+    from[i] = Eigen::Vector3f(f[0], f[1], f[2]);
+    to[i]   = Eigen::Vector3f(t[0], t[1], t[2]);
+  }
+
+  // vertex degrees in the consistency graph, estimated from a fixed number of random partners
+  // (at any distance, long baselines are the most discriminative) to stay linear in n
+  boost::mt19937 rng((this->id_*73856093u) ^ (earlier_node->id_*19349663u));
+  std::vector<std::pair<int, unsigned int> > degree_and_id(n);
+  for (unsigned int i = 0; i < n; i++){
+    int degree = 0;
+    bool all_partners = n <= num_partners + 1;
+    for (unsigned int k = 0; k < (all_partners ? n : num_partners); k++){
+      unsigned int j = all_partners ? k : rng() % n;
+      if (j != i && fabs((from[i]-from[j]).norm() - (to[i]-to[j]).norm()) <= max_dist_m)
+        degree++;
+    }
+    degree_and_id[i] = std::make_pair(-degree, i); //negative: sort descending, ties by index
+  }
+  std::sort(degree_and_id.begin(), degree_and_id.end());
+
+  // greedy max-clique among the max_candidates matches of highest degree: add them in order 
+  // of decreasing degree if they are consistent with all members
+  const unsigned int num_candidates = std::min(n, max_candidates);
+  std::vector<unsigned int> clique, best_clique;
+  for (unsigned int seed = 0; seed < num_seeds && seed < num_candidates; seed++){
+    clique.clear();
+    clique.push_back(degree_and_id[seed].second);
+    for (unsigned int c = 0; c < num_candidates; c++){
+      unsigned int i = degree_and_id[c].second;
+      if (c == seed) continue;
+      bool consistent = true;
+      for (unsigned int k = 0; k < clique.size() && consistent; k++){
+        unsigned int j = clique[k];
+        consistent = fabs((from[i]-from[j]).norm() - (to[i]-to[j]).norm()) <= max_dist_m;
+      }
+      if (consistent) clique.push_back(i);
+    }
+    if (clique.size() > best_clique.size()) best_clique.swap(clique);
+  }
+
+  consistent_matches.reserve(best_clique.size());
+  for (unsigned int k = 0; k < best_clique.size(); k++)
+    consistent_matches.push_back(matches[best_clique[k]]);
+}
+
+bool Node::passesPreemptiveTest(const Node* earlier_node,
+    const std::vector<cv::DMatch>& shuffled_matches,
+    unsigned int start,
+    const Eigen::Matrix4f& transformation,
+    double min_inlier_ratio,
+    double squaredMaxInlierDistInM) const{
+
+  const unsigned int min_checked = 10;  // do not decide on fewer correspondences
+  const unsigned int max_checked = 60;  // survivors are scored on all matches anyway
+  const double z = 2.5;                 // rejection threshold in standard deviations
+
+  if (min_inlier_ratio <= 0.0) return true;
+  if (min_inlier_ratio > 1.0) return false;
+  const double var_factor = min_inlier_ratio * (1.0-min_inlier_ratio);
+
+  unsigned int inliers = 0;
+  unsigned int checked_max = std::min((unsigned int)shuffled_matches.size(), max_checked);
+  for (unsigned int j = 0; j < checked_max; j++){
+    const cv::DMatch& match = shuffled_matches[(start + j) % shuffled_matches.size()];
+    const Eigen::Vector4f& origin = this->feature_locations_3d_[match.queryIdx];
+    const Eigen::Vector4f& target = earlier_node->feature_locations_3d_[match.trainIdx];
+    Eigen::Vector4f vec = (transformation * origin) - target;
+    if (vec.dot(vec) <= squaredMaxInlierDistInM) 
+      inliers++;
+
+    unsigned int checked = j+1;
+    // binomial model: a hypothesis with the required inlier ratio would have 
+    // checked*ratio +- sqrt(checked*var) inliers at this point
+    if (checked >= min_checked && 
+        inliers + z*sqrt(checked*var_factor) < checked*min_inlier_ratio){
+      return false;
+    }
+  }
+  return true;
+}
+
 void Node::computeInliersAndError(const std::vector<cv::DMatch>& matches,
     const Eigen::Matrix4f& transformation,
     const std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& origins,
@@ -582,6 +939,10 @@ Eigen::Matrix4f Node::getTransformFromMatches(const Node* earlier_node,
 }
 
 
+// activate to optimize error (with given inlier_cnt_threshold
+// deactivate to optimize number of inliers (with given max_error of max_dist_m
+//#define OPTIMIZE_ERROR
+
 ///Find transformation with largest support, RANSAC style.
 ///Return false if no transformation can be found
 bool Node::getRelativeTransformationTo(const Node* earlier_node,
@@ -614,74 +975,151 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
     ROS_INFO("Only %d feature matches between %d and %d (minimal: %i)",(int)initial_matches->size() , this->id_, earlier_node->id_, min_feature_cnt);
     return false;
   }
-  std::vector<cv::DMatch> inlier; //holds those feature correspondences that support the transformation
-  double inlier_error; //all squared errors
-  srand((long)std::clock());
   
   // a point is an inlier if it's no more than max_dist_m m from its partner apart
   float max_dist_m = 0.03;
-  const unsigned int sample_size = 3;// chose this many randomly from the correspondences:
-  vector<double> errors;
-  vector<double> temp_errorsA;
-
-
-  // activate to optimize error (with given inlier_cnt_threshold
-  // deactivate to optimize number of inliers (with given max_error of max_dist_m
-//#define OPTIMIZE_ERROR
 
 #ifndef OPTIMIZE_ERROR
   max_dist_m = 0.04;
 #endif
 
+  // Hypotheses are first only generated from a set of geometrically consistent matches. If that 
+  // set is large enough, it mostly contains inliers and few iterations suffice. If the greedy 
+  // set was wrong and no model is found, RANSAC runs again on all matches
+  std::vector<cv::DMatch> consistent_matches;
+  filterConsistentMatches(earlier_node, *initial_matches, max_dist_m, consistent_matches);
+  bool use_consistent = consistent_matches.size() >= min_inlier_threshold;
+  ROS_DEBUG("%i of %i matches are geometrically consistent", (int) consistent_matches.size(), (int) initial_matches->size());
+
+  // Split the hypotheses into independently seeded streams. The seeds only depend on 
+  // global_ransac_seed and the node ids, so the result does not depend on the scheduling
+  unsigned int base_seed = global_ransac_seed != 0 ? global_ransac_seed : (unsigned int) std::clock();
+  unsigned int stream_cnt = std::max(1u, global_ransac_streams);
+  RansacStreamVector streams(stream_cnt);
+  int valid_iterations = 0, preempted_iterations = 0, total_iterations = 0;
+  int best_stream = -1;
+  for (int pass = use_consistent ? 0 : 1; pass < 2 && best_stream < 0; pass++){
+    const std::vector<cv::DMatch>* sample_pool = (pass == 0) ? &consistent_matches : initial_matches;
+    unsigned int pass_iterations = (pass == 0) ? std::min(ransac_iterations, 100u) : ransac_iterations;
+    total_iterations += pass_iterations;
+    for (unsigned int s = 0; s < stream_cnt; s++){
+      streams[s].seed = base_seed ^ (this->id_*73856093u) ^ (earlier_node->id_*19349663u) ^ (s*83492791u);
+      streams[s].iterations = pass_iterations / stream_cnt + (s < pass_iterations % stream_cnt ? 1 : 0);
+    }
+
+    // ROS_INFO("running %i iterations with %i initial matches, min_match: %i, max_error: %.2f", (int) ransac_iterations, (int) initial_matches->size(), (int) min_inlier_threshold, max_dist_m*100 );
+
+    QtConcurrent::blockingMap(streams, boost::bind(&Node::runRansacStream, this, earlier_node, 
+                                                   initial_matches, sample_pool, min_inlier_threshold, max_dist_m, _1));
+
+    // Reduction: Take the best model over all streams. Ties are resolved by the stream order, 
+    // so the result is deterministic
+    for (unsigned int s = 0; s < stream_cnt; s++){
+      valid_iterations += streams[s].valid_iterations;
+      preempted_iterations += streams[s].preempted_iterations;
+      if (streams[s].inliers.size() < min_inlier_threshold) continue;
+      if (best_stream < 0) { best_stream = s; continue; }
+#ifdef OPTIMIZE_ERROR
+      if (streams[s].rmse < streams[best_stream].rmse) { // size is at least min_inlier_thresholds
+#else
+      if (streams[s].inliers.size() > streams[best_stream].inliers.size()) { // inlier_error is at most max_dist_m
+#endif
+        best_stream = s;
+      }
+    }
+    if (pass == 0 && best_stream < 0)
+      ROS_DEBUG("No model from the consistent matches, sampling from all matches");
+  }
+  if (best_stream >= 0){
+    resulting_transformation = streams[best_stream].transformation;
+    matches = streams[best_stream].inliers;
+    rmse = streams[best_stream].rmse;
+  }
+
+  ROS_INFO("%i good iterations (from %i, %i preempted), inlier pct %i, inlier cnt: %i, error: %.2f cm",valid_iterations, total_iterations, preempted_iterations, (int) (matches.size()*1.0/initial_matches->size()*100),(int) matches.size(),rmse*100);
+
+   // ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "getRelativeTransformationTo runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
+
+   return matches.size() >= min_inlier_threshold;
+}
+
+void Node::runRansacStream(const Node* earlier_node,
+    const std::vector<cv::DMatch>* initial_matches,
+    const std::vector<cv::DMatch>* sample_pool,
+    unsigned int min_inlier_threshold,
+    float max_dist_m,
+    RansacStream& stream) const{
+
+  boost::mt19937 rng(stream.seed); //not shared with other streams, unlike rand()
+
+  stream.inliers.clear();
+  stream.rmse = 1e6;
+  stream.valid_iterations = 0;
+
+  stream.preempted_iterations = 0;
+
+  std::vector<cv::DMatch> inlier; //holds those feature correspondences that support the transformation
+  double inlier_error; //all squared errors
+  const unsigned int sample_size = 3;// chose this many randomly from the correspondences:
+  vector<double> temp_errorsA;
+
+  // random order of the matches for the preemptive test (Fisher-Yates with the stream's engine)
+  std::vector<cv::DMatch> shuffled_matches(*initial_matches);
+  for (unsigned int i = shuffled_matches.size()-1; i > 0; i--)
+    std::swap(shuffled_matches[i], shuffled_matches[rng() % (i+1)]);
+
   double best_error = 1e6;
   uint best_inlier_cnt = 0;
 
-  int valid_iterations = 0;
   Eigen::Matrix4f transformation;
 
-  // best values of all iterations (including invalids)
-  double best_error_invalid = 1e6;
-  uint best_inlier_invalid = 0;
-
-  
-  
-  // ROS_INFO("running %i iterations with %i initial matches, min_match: %i, max_error: %.2f", (int) ransac_iterations, (int) initial_matches->size(), (int) min_inlier_threshold, max_dist_m*100 );
-
-  for (uint n_iter = 0; n_iter < ransac_iterations; n_iter++) {
-    //generate a map of samples. Using a map solves the problem of drawing a sample more than once
+  for (uint n_iter = 0; n_iter < stream.iterations; n_iter++) {
+    // ROS_INFO("iteration %d of %d", n_iter,stream.iterations);
 
-    // ROS_INFO("iteration %d of %d", n_iter,ransac_iterations);
+    //draw pairwise different matches
+    unsigned int sample_ids[sample_size];
+    if(!MinimalPoseSolver<sample_size>::drawSample(rng, sample_pool->size(), sample_ids))
+      break;
 
-    std::set<cv::DMatch> sample_matches;
-    std::vector<cv::DMatch> sample_matches_vector;
-    while(sample_matches.size() < sample_size){
-      int id = rand() % initial_matches->size();
-      sample_matches.insert(initial_matches->at(id));
-      sample_matches_vector.push_back(initial_matches->at(id));
+    Eigen::Vector3f sample_from[sample_size], sample_to[sample_size];
+    for (unsigned int i = 0; i < sample_size; i++){
+      const Eigen::Vector4f& from = this->feature_locations_3d_[(*sample_pool)[sample_ids[i]].queryIdx];
+      const Eigen::Vector4f& to = earlier_node->feature_locations_3d_[(*sample_pool)[sample_ids[i]].trainIdx];
+      sample_from[i] = Eigen::Vector3f(from[0], from[1], from[2]);
+      sample_to[i]   = Eigen::Vector3f(to[0], to[1], to[2]);
     }
 
-    bool valid;
+    // the sampled points need to be inliers themselves, i.e. the distances 
+    // between them need to be preserved
+    if (!MinimalPoseSolver<sample_size>::distancesConsistent(sample_from, sample_to, max_dist_m))
+      continue;
 
-    transformation = getTransformFromMatches(earlier_node, sample_matches.begin(), sample_matches.end(),&valid,max_dist_m);
+    // false for degenerate (collinear) samples
+    if (!MinimalPoseSolver<sample_size>::solve(sample_from, sample_to, transformation))
+      continue;
 
-    // valid is false iff the sampled points aren't inliers themself 
-    if (!valid)
+    // Discard hopeless hypotheses after a few correspondences. To be of any use, 
+    // a hypothesis needs at least min_inlier_threshold inliers and has to beat the best one
+#ifdef OPTIMIZE_ERROR
+    double required_inlier_ratio = min_inlier_threshold / (double) initial_matches->size();
+#else
+    double required_inlier_ratio = std::max(min_inlier_threshold, best_inlier_cnt) / (double) initial_matches->size();
+#endif
+    // each hypothesis is tested on a different random part of the shuffled matches, 
+    // so an unlucky part does not reject all hypotheses of the stream
+    unsigned int start = shuffled_matches.empty() ? 0 : rng() % shuffled_matches.size();
+    if (!passesPreemptiveTest(earlier_node, shuffled_matches, start, transformation, 
+                              required_inlier_ratio, max_dist_m*max_dist_m)){
+      stream.preempted_iterations++;
       continue;
+    }
 
     computeInliersAndError(*initial_matches, transformation, this->feature_locations_3d_, 
         earlier_node->feature_locations_3d_, inlier, inlier_error,  /*output*/
         temp_errorsA, max_dist_m*max_dist_m); /*output*/
 
-    // check also invalid iterations
-    if (inlier.size() > best_inlier_invalid)
-    {
-      best_inlier_invalid = inlier.size();
-      best_error_invalid = inlier_error;
-    }
-
     // ROS_INFO("iteration %d  cnt: %d, best: %d,  error: %.2f",n_iter, (int) inlier.size(), best_inlier_cnt, inlier_error*100);
 
-
     if(inlier.size() < min_inlier_threshold){
       //inlier.size() < ((float)initial_matches->size())*min_inlier_ratio || 
       // ROS_INFO("Skipped iteration: inliers: %i (min %i), inlier_error: %.2f (max %.2f)", (int)inlier.size(), (int) min_inlier_threshold,  inlier_error*100, max_dist_m*100);
@@ -690,7 +1128,7 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
     assert(inlier_error <= max_dist_m && inlier_error>0);
 
     // ROS_INFO("Refining iteration from %i samples: all matches: %i, inliers: %i, inlier_error: %f", (int)sample_size, (int)initial_matches->size(), (int)inlier.size(), inlier_error);
-    valid_iterations++;
+    stream.valid_iterations++;
 
 
     //Performance hacks:
@@ -705,39 +1143,24 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
 #else
     if (inlier.size() > best_inlier_cnt) { // inlier_error is at most max_dist_m
 #endif
-    	resulting_transformation = transformation;
-      matches = inlier;
-      assert(matches.size()>= min_inlier_threshold);
+      stream.transformation = transformation;
+      stream.inliers = inlier;
+      assert(stream.inliers.size()>= min_inlier_threshold);
       best_inlier_cnt = inlier.size();
-      //assert(matches.size()>= ((float)initial_matches->size())*min_inlier_ratio);
-      rmse = inlier_error;
-      errors = temp_errorsA;
+      stream.rmse = inlier_error;
       best_error = inlier_error;
       // ROS_INFO("  new best iteration %d  cnt: %d, best_inlier: %d,  error: %.4f, bestError: %.4f",n_iter, inlier.size(), best_inlier_cnt, inlier_error, best_error);
-
-    }else
-    {
-      // ROS_INFO("NO new best iteration %d  cnt: %d, best_inlier: %d,  error: %.4f, bestError: %.4f",n_iter, inlier.size(), best_inlier_cnt, inlier_error, best_error);
     }
 
-    //int max_ndx = min((int) min_inlier_threshold,30); //? What is this 30?
     double new_inlier_error;
 
-    transformation = getTransformFromMatches(earlier_node, matches.begin(), matches.end()); // compute new trafo from all inliers:
+    transformation = getTransformFromMatches(earlier_node, stream.inliers.begin(), stream.inliers.end()); // compute new trafo from all inliers:
     computeInliersAndError(*initial_matches, transformation,
         this->feature_locations_3d_, earlier_node->feature_locations_3d_,
         inlier, new_inlier_error, temp_errorsA, max_dist_m*max_dist_m);
 
     // ROS_INFO("asd recomputed: inliersize: %i, inlier error: %f", (int) inlier.size(),100*new_inlier_error);
 
-
-    // check also invalid iterations
-    if (inlier.size() > best_inlier_invalid)
-    {
-      best_inlier_invalid = inlier.size();
-      best_error_invalid = inlier_error;
-    }
-
     if(inlier.size() < min_inlier_threshold){ continue; }
 
     assert(new_inlier_error>0 && new_inlier_error < max_dist_m);
@@ -747,25 +1170,15 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
 #else
     if (inlier.size() > best_inlier_cnt) { // inlier_error is at most max_dist_m
 #endif
-      resulting_transformation = transformation;
-      matches = inlier;
-      assert(matches.size()>= min_inlier_threshold);
-      //assert(matches.size()>= ((float)initial_matches->size())*min_inlier_ratio);
-      rmse = new_inlier_error;
-      errors = temp_errorsA;
+      stream.transformation = transformation;
+      stream.inliers = inlier;
+      assert(stream.inliers.size()>= min_inlier_threshold);
+      best_inlier_cnt = inlier.size();
+      stream.rmse = new_inlier_error;
       best_error = new_inlier_error;
       // ROS_INFO("  improved: new best iteration %d  cnt: %d, best_inlier: %d,  error: %.2f, bestError: %.2f",n_iter, inlier.size(), best_inlier_cnt, inlier_error*100, best_error*100);
-    }else
-    {
-      // ROS_INFO("improved: NO new best iteration %d  cnt: %d, best_inlier: %d,  error: %.2f, bestError: %.2f",n_iter, inlier.size(), best_inlier_cnt, inlier_error*100, best_error*100);
     }
   } //iterations
-  ROS_INFO("%i good iterations (from %i), inlier pct %i, inlier cnt: %i, error: %.2f cm",valid_iterations, (int) ransac_iterations, (int) (matches.size()*1.0/initial_matches->size()*100),(int) matches.size(),rmse*100);
-  // ROS_INFO("best overall: inlier: %i, error: %.2f",best_inlier_invalid, best_error_invalid*100);
-
-   // ROS_INFO_STREAM_COND_NAMED(( (std::clock()-starttime) / (double)CLOCKS_PER_SEC) > global_min_time_reported, "timings", "getRelativeTransformationTo runtime: "<< ( std::clock() - starttime ) / (double)CLOCKS_PER_SEC  <<"sec");
-
-   return matches.size() >= min_inlier_threshold;
 }
 
 
@@ -813,9 +1226,8 @@ MatchingResult Node::matchNodePair(const Node* older_node){
 
       mr.final_trafo = mr.ransac_trafo;
       
-#ifdef USE_ICP_CODE
-      getRelativeTransformationTo_ICP_code(older_node,mr.icp_trafo, &mr.ransac_trafo);
-#endif  
+      // With USE_ICP_CODE, the GraphManager refines accepted edges (see addNode), 
+      // as the GICP structures of this node only exist after acceptance
       
 #ifdef USE_ICP_BIN
       // improve transformation by using the generalized ICP
@@ -889,11 +1301,31 @@ MatchingResult Node::matchNodePair(const Node* older_node){
 #endif
 #endif
 
+      if (global_use_projective_icp){
+        // dense refinement, kept only if it agrees with the feature correspondences
+        Eigen::Matrix4f dense_trafo = mr.final_trafo;
+        if (refineTransformationProjectiveICP(older_node, dense_trafo)){
+          vector<double> errors;
+          double error;
+          std::vector<cv::DMatch> inliers;
+          computeInliersAndError(mr.inlier_matches, dense_trafo,
+              this->feature_locations_3d_, older_node->feature_locations_3d_,
+              inliers, error, errors, 0.04*0.04); 
+          // nearly all feature inliers have to survive, at no larger error
+          if (error >= 0 && error <= mr.rmse && inliers.size() * 10 >= mr.inlier_matches.size() * 9){
+            mr.final_trafo = dense_trafo;
+            mr.inlier_matches = inliers; //the information matrix must only count the remaining ones
+            mr.rmse = error;
+          } else
+            ROS_INFO("Projective ICP disagrees with the features (error %f, was %f). Keeping the RANSAC result", error, mr.rmse);
+        }
+      }
+
 
       mr.edge.id1 = older_node->id_;//and we have a valid transformation
       mr.edge.id2 = this->id_; //since there are enough matching features,
       mr.edge.mean = eigen2Hogman(mr.final_trafo);//we insert an edge between the frames
-      mr.edge.informationMatrix =   Matrix6::eye(mr.inlier_matches.size()*mr.inlier_matches.size()); //TODO: What do we do about the information matrix? Scale with inlier_count. Should rmse be integrated?)
+      mr.edge.informationMatrix = computeInformationMatrix(older_node, mr.inlier_matches, mr.final_trafo);
     }
   }
   // Paper
@@ -901,6 +1333,48 @@ MatchingResult Node::matchNodePair(const Node* older_node){
   return mr;
 }
 
+Matrix6 Node::computeInformationMatrix(const Node* older_node,
+    const std::vector<cv::DMatch>& inliers,
+    const Eigen::Matrix4f& transformation) const{
+  // Noise model of the kinect (Khoshelham 2011): The depth error grows quadratically with the 
+  // distance, the lateral error linearly (here: a feature localization error of one pixel)
+  const double depth_noise_factor = 1.425e-3; // sigma_z = factor * z^2
+  const double lateral_noise_factor = 1.0/525.0; // sigma_xy = factor * z
+  typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+
+  const Eigen::Matrix3d rotation = transformation.block<3,3>(0,0).cast<double>();
+  Matrix6d information = Matrix6d::Zero();
+  for (unsigned int i = 0; i < inliers.size(); i++){
+    const Eigen::Vector4f& from = this->feature_locations_3d_[inliers[i].queryIdx];
+    const Eigen::Vector4f& to = older_node->feature_locations_3d_[inliers[i].trainIdx];
+    if (!(from[2] > 0) || !(to[2] > 0)) continue; //also catches NaN
+
+    // Covariance of the residual to - T*from, in the frame of the older node
+    Eigen::Matrix3d cov_from = Eigen::Matrix3d::Zero(), cov_to = Eigen::Matrix3d::Zero();
+    double sigma_xy = lateral_noise_factor * from[2], sigma_z = depth_noise_factor * from[2] * from[2];
+    cov_from.diagonal() << sigma_xy*sigma_xy, sigma_xy*sigma_xy, sigma_z*sigma_z;
+    sigma_xy = lateral_noise_factor * to[2]; sigma_z = depth_noise_factor * to[2] * to[2];
+    cov_to.diagonal() << sigma_xy*sigma_xy, sigma_xy*sigma_xy, sigma_z*sigma_z;
+    Eigen::Matrix3d residual_information = (cov_to + rotation * cov_from * rotation.transpose()).inverse();
+
+    // Jacobian w.r.t. a local perturbation (translation, small rotation) of the transformation:
+    // d(T*exp(delta)*p) = R * [I | -[p]x] * delta
+    Eigen::Matrix<double, 3, 6> jacobian;
+    jacobian.block<3,3>(0,0) = Eigen::Matrix3d::Identity();
+    jacobian.block<3,3>(0,3) <<        0.0,  from[2], -from[1],
+                                  -from[2],      0.0,  from[0],
+                                   from[1], -from[0],      0.0;
+    jacobian = rotation * jacobian;
+    information += jacobian.transpose() * residual_information * jacobian;
+  }
+
+  Matrix6 result;
+  for (int r = 0; r < 6; r++)
+    for (int c = 0; c < 6; c++)
+      result[r][c] = information(r,c);
+  return result;
+}
+
 ///Get euler angles from affine matrix (helper for isBigTrafo)
 void Node::mat2RPY(const Eigen::Matrix4f& t, double& roll, double& pitch, double& yaw) {
   roll = atan2(t(2,1),t(2,2));
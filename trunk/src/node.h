@@ -46,6 +46,7 @@
 #ifdef USE_ICP_CODE
 #include "../gicp/gicp.h"
 #include "../gicp/transform.h"
+#include <QFuture>
 #endif
 
 #include "matching_result.h" 
@@ -54,6 +55,23 @@
 // Search structure for descriptormatching
 typedef cv::flann::Index cv_flannIndex;
 
+///One independently seeded sequence of RANSAC hypotheses.
+///The streams are evaluated in parallel by getRelativeTransformationTo
+///and reduced to the best model afterwards
+struct RansacStream {
+	unsigned int seed;         ///<seed of the stream's own random engine
+	unsigned int iterations;   ///<number of hypotheses to draw
+	//Results
+	Eigen::Matrix4f transformation;
+	std::vector<cv::DMatch> inliers;
+	double rmse;
+	unsigned int valid_iterations;
+	unsigned int preempted_iterations; ///<hypotheses rejected by the preemptive test
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+typedef std::vector<RansacStream, Eigen::aligned_allocator<RansacStream> > RansacStreamVector;
+
 //!Holds the data for one graph node and provides functionality to compute relative transformations to other Nodes.
 class Node {
 public:
@@ -86,6 +104,9 @@ public:
 	///Iterations with more than half of the initial_matches 
 	///inlying, count twice. Iterations with more than 80% of 
 	///the initial_matches inlying, count threefold
+	///The hypotheses are split into global_ransac_streams streams, which 
+	///are evaluated concurrently. With a fixed global_ransac_seed the result
+	///is reproducible.
 	bool getRelativeTransformationTo(const Node* target_node, 
 			std::vector<cv::DMatch>* initial_matches,
 			Eigen::Matrix4f& resulting_transformation, 
@@ -103,6 +124,10 @@ public:
 #ifdef USE_ICP_CODE
 	bool getRelativeTransformationTo_ICP_code(const Node* target_node,Eigen::Matrix4f& transformation,
 			const Eigen::Matrix4f* initial_transformation = NULL);
+	///Refine the edge of mr (from matchNodePair) with GICP, starting at its final_trafo. The 
+	///result replaces the edge only if it converged and agrees with the feature inliers.
+	///Waits for the GICP structures of both nodes
+	bool refineEdgeICP_code(const Node* older_node, MatchingResult& mr);
 #endif
 
 
@@ -114,24 +139,56 @@ public:
 	// void moveAndPublishRansac(const Eigen::Matrix4f& trafo);
 
 	void buildFlannIndex();
+	///Fill dense_normals_, which refineTransformationProjectiveICP needs for the target node.
+	///Only called for nodes accepted into the graph
+	void computeDenseNormals();
 	int findPairsFlann(const Node* other, vector<cv::DMatch>* matches) const;
 
+	///Dense point-to-plane ICP with projective data association: The points of this node are
+	///projected into the image of target_node and paired with the point at that pixel, using the
+	///cached normals of target_node. transformation (this -> target_node) holds the initial guess 
+	///and is overwritten with the result. Returns false (leaving transformation untouched) for 
+	///unorganized clouds or too few associations
+	bool refineTransformationProjectiveICP(const Node* target_node, Eigen::Matrix4f& transformation) const;
+
+	static const int projective_icp_normal_step = 2;  ///< normals are cached for every n-th pixel (in u and v)
+	static const int projective_icp_sample_step = 4;  ///< use every n-th pixel (in u and v) as source point
+	static const unsigned int projective_icp_iterations = 10;
+	static const double projective_icp_max_dist = 0.05; ///< reject associations further apart (in m)
+	static const double projective_icp_focal_length = 525.0;       ///< of the kinect at projective_icp_reference_width
+	static const unsigned int projective_icp_reference_width = 640; ///< the focal length is scaled to other resolutions
+
 #ifdef USE_ICP_CODE
 
-	dgc::gicp::GICPPointSet* gicp_point_set;
+	dgc::gicp::GICPPointSet* gicp_point_set; ///< finest level of gicp_pyramid_
+	///Voxel grid subsampled point sets, from coarse to fine. The cell size is 
+	///gicp_finest_voxel_size on the finest level and doubles on every coarser level
+	std::vector<dgc::gicp::GICPPointSet*> gicp_pyramid_;
 	
 	static const double gicp_epsilon = 1e-4;
-	static const double gicp_d_max = 0.10; // 10cm
+	static const double gicp_d_max = 0.10; ///< 10cm on the coarsest level, halved on every finer level
 	static const unsigned int gicp_max_iterations = 200;
-	static const unsigned int gicp_point_cnt = 20000;
+	static const unsigned int gicp_point_cnt = 20000; ///< maximal number of points per level
+	static const unsigned int gicp_pyramid_levels = 3; ///< i.e., 4cm, 2cm and 1cm voxels
+	static const double gicp_finest_voxel_size = 0.01;
+	static const bool gicp_organized_covariances = true; ///< use IntegralCovarianceEstimator for organized clouds
 		
 	bool gicp_initialized;
 	
 	void Eigen2GICP(const Eigen::Matrix4f& m, dgc_transform_t g_m);
 	void GICP2Eigen(const dgc_transform_t g_m, Eigen::Matrix4f& m);
 	void gicpSetIdentity(dgc_transform_t m);
+	///Build gicp_pyramid_ (point sets, kd-trees and covariances) with at most max_count points per level
 	void createGICPStructures(unsigned int max_count = 1000);
 
+	///Build the GICP point set, kd-tree and covariances in the background. Called once the
+	///node is accepted into the graph, further calls have no effect.
+	void startGICPStructures();
+	///Block until the structures started by startGICPStructures are available
+	void waitForGICPStructures() const;
+	mutable QFuture<void> gicp_future_;
+	bool gicp_started_;
+
 #endif
 
 
@@ -144,6 +201,10 @@ public:
 	std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > feature_locations_3d_;  ///<backprojected 3d descriptor locations relative to cam position in homogeneous coordinates (last dimension is 1.0)
 	std::vector<cv::KeyPoint> feature_locations_2d_; ///<Where in the image are the descriptors
 	unsigned int id_; ///must correspond to the hogman vertex id
+	///Surface normals of pc_col for every projective_icp_normal_step-th pixel and row (from integral 
+	///images, NaN where undefined). Empty for unorganized clouds, before computeDenseNormals was 
+	///called or if global_use_projective_icp is false
+	std::vector<Eigen::Vector3f> dense_normals_;
 
 protected:
 
@@ -199,6 +260,42 @@ protected:
 
 	void mat2components(const Eigen::Matrix4f& t, double& roll, double& pitch, double& yaw, double& dist);
 
+	///Evaluate the hypotheses of one RANSAC stream (helper for getRelativeTransformationTo)
+	///Only uses its own random engine, therefore it is safe to run several streams concurrently
+	void runRansacStream(const Node* earlier_node,
+			const std::vector<cv::DMatch>* initial_matches,
+			const std::vector<cv::DMatch>* sample_pool,
+			unsigned int min_inlier_threshold,
+			float max_dist_m,
+			RansacStream& stream) const;
+
+	///Prefilter for RANSAC: Extract a large set of mutually consistent matches, i.e., 
+	///pairs of matches whose 3D distance is preserved up to max_dist_m in both nodes.
+	///The vertex degrees of the consistency graph are estimated from random partners and a 
+	///clique is grown greedily among the matches of highest degree.
+	void filterConsistentMatches(const Node* earlier_node,
+			const std::vector<cv::DMatch>& matches,
+			float max_dist_m,
+			std::vector<cv::DMatch>& consistent_matches) const;
+
+	///Preemptive scoring of a RANSAC hypothesis (bail-out test). The matches are checked
+	///in the given order (which should be random) from start on, wrapping around. Returns 
+	///false as soon as the inlier count is significantly below what a model with 
+	///min_inlier_ratio would produce.
+	bool passesPreemptiveTest(const Node* earlier_node,
+			const std::vector<cv::DMatch>& shuffled_matches,
+			unsigned int start,
+			const Eigen::Matrix4f& transformation,
+			double min_inlier_ratio,
+			double squaredMaxInlierDistInM) const;
+
+	///Information matrix of the edge from the inlier correspondences: Sum of J^T Sigma^-1 J of the 
+	///point-to-point residuals, where Sigma is given by the depth noise of the kinect
+	///(grows quadratically with the distance). Ordering is (x,y,z,roll,pitch,yaw) as in hogman.
+	Matrix6 computeInformationMatrix(const Node* older_node,
+			const std::vector<cv::DMatch>& inliers,
+			const Eigen::Matrix4f& transformation) const;
+
 	// helper for ransac
 	void computeInliersAndError(const std::vector<cv::DMatch>& initial_matches,
 			const Eigen::Matrix4f& transformation,
@@ -0,0 +1,474 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "pose_graph_lm.h"
+#include <Eigen/Cholesky>
+#include <Eigen/Geometry>
+#if EIGEN_VERSION_AT_LEAST(3,1,0)
+#include <Eigen/Sparse>
+#include <Eigen/OrderingMethods>
+#endif
+#include <QtConcurrentMap>
+#include <QThread>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+
+namespace {
+const int min_edges_per_task = 64;
+
+Eigen::Matrix3d skew(const Eigen::Vector3d& v){
+  Eigen::Matrix3d m;
+  m <<     0, -v(2),  v(1),
+        v(2),     0, -v(0),
+       -v(1),  v(0),     0;
+  return m;
+}
+
+///Rotation vector of a rotation matrix, with an angle in [0, pi]
+Eigen::Vector3d logRotation(const Eigen::Matrix3d& rotation){
+  Eigen::Quaterniond q(rotation);
+  if(q.w() < 0) q.coeffs() = -q.coeffs();
+  double n = q.vec().norm();
+  if(n < 1e-10) return 2.0 * q.vec();
+  return (2.0 * std::atan2(n, q.w()) / n) * q.vec();
+}
+
+Eigen::Matrix3d expRotation(const Eigen::Vector3d& phi){
+  double angle = phi.norm();
+  if(angle < 1e-10) return Eigen::Matrix3d::Identity() + skew(phi);
+  return Eigen::AngleAxisd(angle, phi / angle).toRotationMatrix();
+}
+
+///Inverse of the right Jacobian of SO(3): d log(R * exp(dphi)) / d dphi
+Eigen::Matrix3d inverseRightJacobian(const Eigen::Vector3d& phi){
+  double angle = phi.norm();
+  Eigen::Matrix3d phi_x = skew(phi);
+  if(angle < 1e-6) return Eigen::Matrix3d::Identity() + 0.5 * phi_x;
+  double factor = 1.0 / (angle * angle) - (1.0 + std::cos(angle)) / (2.0 * angle * std::sin(angle));
+  return Eigen::Matrix3d::Identity() + 0.5 * phi_x + factor * phi_x * phi_x;
+}
+
+///Roll, pitch and yaw for rotation = Rz(yaw) * Ry(pitch) * Rx(roll)
+Eigen::Vector3d rotationToRPY(const Eigen::Matrix3d& r){
+  return Eigen::Vector3d(std::atan2(r(2,1), r(2,2)),
+                         std::atan2(-r(2,0), std::sqrt(r(2,1)*r(2,1) + r(2,2)*r(2,2))),
+                         std::atan2(r(1,0), r(0,0)));
+}
+
+Eigen::Matrix3d rpyToRotation(double roll, double pitch, double yaw){
+  return (Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()) *
+          Eigen::AngleAxisd(pitch, Eigen::Vector3d::UnitY()) *
+          Eigen::AngleAxisd(roll, Eigen::Vector3d::UnitX())).toRotationMatrix();
+}
+}
+
+PoseGraphLM::PoseGraphLM() {}
+
+int PoseGraphLM::addVertex(const Pose& pose, bool fixed){
+  poses_.push_back(pose);
+  fixed_.push_back(fixed);
+  return (int)poses_.size() - 1;
+}
+
+void PoseGraphLM::addEdge(int from, int to, const Pose& mean, const Matrix6d& information){
+  Edge edge;
+  edge.from = from;
+  edge.to = to;
+  edge.mean = mean;
+  edge.information = information;
+  edges_.push_back(edge);
+}
+
+void PoseGraphLM::clear(){
+  poses_.clear();
+  fixed_.clear();
+  edges_.clear();
+}
+
+PoseGraphLM::Pose PoseGraphLM::boxPlus(const Pose& pose, const Vector6d& delta){
+  return Pose(pose.rotation * expRotation(delta.tail<3>()), pose.translation + pose.rotation * delta.head<3>());
+}
+
+PoseGraphLM::Vector6d PoseGraphLM::edgeError(const Pose& from, const Pose& to, const Pose& mean){
+  Pose e = mean.inverse() * from.inverse() * to;
+  Vector6d error;
+  error << e.translation, logRotation(e.rotation);
+  return error;
+}
+
+// E = Z^-1 X_f^-1 X_t. Moving X_t by exp(d) gives E exp(d). Moving X_f by exp(d) gives
+// E exp(-Ad(X_t^-1 X_f) d), where Ad(R,t) = [R, [t]x R; 0, R] for [translation; rotation]
+void PoseGraphLM::linearizeEdge(const Pose& from, const Pose& to, const Pose& mean,
+                                Vector6d& error, Matrix6d& jacobian_from, Matrix6d& jacobian_to){
+  Pose e = mean.inverse() * from.inverse() * to;
+  Eigen::Vector3d phi = logRotation(e.rotation);
+  error << e.translation, phi;
+
+  jacobian_to.setZero();
+  jacobian_to.topLeftCorner<3,3>() = e.rotation;
+  jacobian_to.bottomRightCorner<3,3>() = inverseRightJacobian(phi);
+
+  Pose relative = to.inverse() * from;
+  Matrix6d adjoint;
+  adjoint.topLeftCorner<3,3>() = relative.rotation;
+  adjoint.topRightCorner<3,3>() = skew(relative.translation) * relative.rotation;
+  adjoint.bottomLeftCorner<3,3>().setZero();
+  adjoint.bottomRightCorner<3,3>() = relative.rotation;
+  jacobian_from = -jacobian_to * adjoint;
+}
+
+double PoseGraphLM::chi2() const {
+  double sum = 0;
+  for(unsigned int i = 0; i < edges_.size(); i++){
+    const Edge& edge = edges_[i];
+    Vector6d e = edgeError(poses_[edge.from], poses_[edge.to], edge.mean);
+    sum += e.dot(edge.information * e);
+  }
+  return sum;
+}
+
+// Minimum degree ordering on the graph of the optimized vertices. Eliminating a vertex
+// connects all of its neighbours, which is the fill-in of the factor. Eigen's approximate
+// minimum degree ordering is much faster on large graphs
+void PoseGraphLM::orderVariables(){
+  const int n = (int)poses_.size();
+  std::vector<bool> optimized(n, false);
+  for(unsigned int i = 0; i < edges_.size(); i++){
+    optimized[edges_[i].from] = !fixed_[edges_[i].from];
+    optimized[edges_[i].to] = !fixed_[edges_[i].to];
+  }
+  position_.assign(n, -1);
+
+#if EIGEN_VERSION_AT_LEAST(3,1,0)
+  std::vector<int> variable(n, -1), vertex;
+  for(int v = 0; v < n; v++){
+    if(!optimized[v]) continue;
+    variable[v] = (int)vertex.size();
+    vertex.push_back(v);
+  }
+  std::vector<Eigen::Triplet<double> > pattern;
+  for(unsigned int v = 0; v < vertex.size(); v++){
+    pattern.push_back(Eigen::Triplet<double>(v, v, 1.0));
+  }
+  for(unsigned int i = 0; i < edges_.size(); i++){
+    int a = variable[edges_[i].from], b = variable[edges_[i].to];
+    if(a < 0 || b < 0 || a == b) continue;
+    pattern.push_back(Eigen::Triplet<double>(a, b, 1.0));
+    pattern.push_back(Eigen::Triplet<double>(b, a, 1.0));
+  }
+  Eigen::SparseMatrix<double> structure(vertex.size(), vertex.size());
+  structure.setFromTriplets(pattern.begin(), pattern.end());
+  Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> order;
+  Eigen::AMDOrdering<int>()(structure, order);
+  for(int k = 0; k < (int)vertex.size(); k++){
+    position_[vertex[order.indices()(k)]] = k;
+  }
+#else
+  std::vector<std::set<int> > adjacency(n);
+  for(unsigned int i = 0; i < edges_.size(); i++){
+    int a = edges_[i].from, b = edges_[i].to;
+    if(a == b || !optimized[a] || !optimized[b]) continue;
+    adjacency[a].insert(b);
+    adjacency[b].insert(a);
+  }
+  std::set<std::pair<int,int> > queue; //(degree, vertex)
+  for(int v = 0; v < n; v++){
+    if(optimized[v]) queue.insert(std::make_pair((int)adjacency[v].size(), v));
+  }
+  int next_position = 0;
+  while(!queue.empty()){
+    int v = queue.begin()->second;
+    queue.erase(queue.begin());
+    position_[v] = next_position++;
+    const std::set<int> neighbours(adjacency[v].begin(), adjacency[v].end());
+    adjacency[v].clear();
+    for(std::set<int>::const_iterator a = neighbours.begin(); a != neighbours.end(); ++a){
+      queue.erase(std::make_pair((int)adjacency[*a].size(), *a));
+      adjacency[*a].erase(v);
+      for(std::set<int>::const_iterator b = neighbours.begin(); b != neighbours.end(); ++b){
+        if(*b != *a) adjacency[*a].insert(*b);
+      }
+      queue.insert(std::make_pair((int)adjacency[*a].size(), *a));
+    }
+  }
+#endif
+}
+
+// The rows of column k of L are those of column k of H below the diagonal plus those of
+// the columns whose first off-diagonal row is k (its children in the elimination tree)
+void PoseGraphLM::symbolicFactorization(){
+  int num_variables = 0;
+  for(unsigned int v = 0; v < position_.size(); v++){
+    if(position_[v] >= 0) num_variables++;
+  }
+  std::vector<std::vector<int> > rows(num_variables);
+  for(unsigned int i = 0; i < edges_.size(); i++){
+    int a = position_[edges_[i].from], b = position_[edges_[i].to];
+    if(a < 0 || b < 0 || a == b) continue;
+    rows[std::min(a, b)].push_back(std::max(a, b));
+  }
+  std::vector<std::vector<int> > children(num_variables);
+  for(int k = 0; k < num_variables; k++){
+    std::vector<int>& column = rows[k];
+    for(unsigned int c = 0; c < children[k].size(); c++){
+      const std::vector<int>& child = rows[children[k][c]];
+      column.insert(column.end(), child.begin() + 1, child.end()); //without row k
+    }
+    std::sort(column.begin(), column.end());
+    column.erase(std::unique(column.begin(), column.end()), column.end());
+    if(!column.empty()) children[column.front()].push_back(k);
+  }
+
+  column_start_.assign(1, 0);
+  block_row_.clear();
+  for(int k = 0; k < num_variables; k++){
+    block_row_.insert(block_row_.end(), rows[k].begin(), rows[k].end());
+    column_start_.push_back((int)block_row_.size());
+  }
+
+  edge_block_.assign(edges_.size(), -1);
+  for(unsigned int i = 0; i < edges_.size(); i++){
+    int a = position_[edges_[i].from], b = position_[edges_[i].to];
+    if(a < 0 || b < 0 || a == b) continue;
+    int column = std::min(a, b);
+    edge_block_[i] = std::lower_bound(block_row_.begin() + column_start_[column],
+                                      block_row_.begin() + column_start_[column+1],
+                                      std::max(a, b)) - block_row_.begin();
+  }
+}
+
+void PoseGraphLM::linearizeRange(EdgeRange& range){
+  Vector6d error;
+  Matrix6d j_from, j_to;
+  for(int i = range.begin; i < range.end; i++){
+    const Edge& edge = edges_[i];
+    linearizeEdge(poses_[edge.from], poses_[edge.to], edge.mean, error, j_from, j_to);
+    EdgeTerms& terms = edge_terms_[i];
+    Matrix6d wj_from = edge.information * j_from;
+    Matrix6d wj_to = edge.information * j_to;
+    terms.h_from.noalias() = j_from.transpose() * wj_from;
+    terms.h_cross.noalias() = wj_from.transpose() * j_to;
+    terms.h_to.noalias() = j_to.transpose() * wj_to;
+    terms.b_from.noalias() = wj_from.transpose() * error;
+    terms.b_to.noalias() = wj_to.transpose() * error;
+  }
+}
+
+void PoseGraphLM::chi2Range(EdgeRange& range) const {
+  range.chi2 = 0;
+  for(int i = range.begin; i < range.end; i++){
+    const Edge& edge = edges_[i];
+    Vector6d e = edgeError(poses_[edge.from], poses_[edge.to], edge.mean);
+    range.chi2 += e.dot(edge.information * e);
+  }
+}
+
+double PoseGraphLM::parallelChi2(std::vector<EdgeRange>& ranges) const {
+  QtConcurrent::blockingMap(ranges, boost::bind(&PoseGraphLM::chi2Range, this, _1));
+  double sum = 0;
+  for(unsigned int r = 0; r < ranges.size(); r++) sum += ranges[r].chi2; //in a fixed order
+  return sum;
+}
+
+// Sums the edge terms into the blocks of the lower triangle of H
+void PoseGraphLM::buildSystem(){
+  int num_variables = (int)column_start_.size() - 1;
+  hessian_diagonal_.assign(num_variables, Matrix6d::Zero());
+  hessian_blocks_.assign(block_row_.size(), Matrix6d::Zero());
+  gradient_.assign(num_variables, Vector6d::Zero());
+  for(unsigned int i = 0; i < edges_.size(); i++){
+    const EdgeTerms& terms = edge_terms_[i];
+    int a = position_[edges_[i].from], b = position_[edges_[i].to];
+    if(a >= 0){
+      hessian_diagonal_[a] += terms.h_from;
+      gradient_[a] += terms.b_from;
+    }
+    if(b >= 0){
+      hessian_diagonal_[b] += terms.h_to;
+      gradient_[b] += terms.b_to;
+    }
+    if(edge_block_[i] >= 0){
+      if(a > b) hessian_blocks_[edge_block_[i]] += terms.h_cross;
+      else      hessian_blocks_[edge_block_[i]] += terms.h_cross.transpose();
+    }
+    else if(a >= 0 && a == b){ //an edge from a vertex to itself
+      hessian_diagonal_[a] += terms.h_cross + terms.h_cross.transpose();
+    }
+  }
+}
+
+// Right-looking block Cholesky factorization of H + lambda * diag(H)
+bool PoseGraphLM::factorize(double lambda){
+  int num_variables = (int)column_start_.size() - 1;
+  factor_diagonal_ = hessian_diagonal_;
+  factor_blocks_ = hessian_blocks_;
+  for(int k = 0; k < num_variables; k++){
+    factor_diagonal_[k].diagonal() += lambda * hessian_diagonal_[k].diagonal();
+  }
+
+  for(int k = 0; k < num_variables; k++){
+    Eigen::LLT<Matrix6d> llt(factor_diagonal_[k]);
+    if(llt.info() != Eigen::Success) return false;
+    factor_diagonal_[k] = llt.matrixL();
+    const int begin = column_start_[k], end = column_start_[k+1];
+    for(int p = begin; p < end; p++){ // L_ik = A_ik * L_kk^-T
+      factor_blocks_[p] = llt.matrixL().solve(factor_blocks_[p].transpose()).transpose();
+    }
+    // A_ij -= L_ik * L_jk^T for the rows i >= j of column k. The rows i > j are a subset of
+    // the rows of column j, both are sorted
+    for(int q = begin; q < end; q++){
+      const int j = block_row_[q];
+      const Matrix6d& l_jk = factor_blocks_[q];
+      factor_diagonal_[j].noalias() -= l_jk * l_jk.transpose();
+      int block = column_start_[j];
+      for(int p = q + 1; p < end; p++){
+        while(block_row_[block] < block_row_[p]) block++;
+        factor_blocks_[block].noalias() -= factor_blocks_[p] * l_jk.transpose();
+      }
+    }
+  }
+  return true;
+}
+
+// Solves L L^T delta = -gradient
+void PoseGraphLM::solve(VectorBlockVector& delta) const {
+  int num_variables = (int)column_start_.size() - 1;
+  delta.resize(num_variables);
+  for(int k = 0; k < num_variables; k++) delta[k] = -gradient_[k];
+  for(int k = 0; k < num_variables; k++){
+    factor_diagonal_[k].triangularView<Eigen::Lower>().solveInPlace(delta[k]);
+    for(int p = column_start_[k]; p < column_start_[k+1]; p++){
+      delta[block_row_[p]].noalias() -= factor_blocks_[p] * delta[k];
+    }
+  }
+  for(int k = num_variables - 1; k >= 0; k--){
+    for(int p = column_start_[k]; p < column_start_[k+1]; p++){
+      delta[k].noalias() -= factor_blocks_[p].transpose() * delta[block_row_[p]];
+    }
+    factor_diagonal_[k].transpose().triangularView<Eigen::Upper>().solveInPlace(delta[k]);
+  }
+}
+
+int PoseGraphLM::optimize(int max_iterations, double min_improvement){
+  if(edges_.empty()) return 0;
+  orderVariables();
+  symbolicFactorization();
+  if(column_start_.size() <= 1) return 0; //nothing to optimize
+  edge_terms_.resize(edges_.size());
+
+  const int num_edges = (int)edges_.size();
+  int tasks = std::max(1, std::min(4 * QThread::idealThreadCount(), num_edges / min_edges_per_task));
+  std::vector<EdgeRange> ranges(tasks);
+  for(int t = 0; t < tasks; t++){
+    ranges[t].begin = (int)((long long)num_edges * t / tasks);
+    ranges[t].end = (int)((long long)num_edges * (t+1) / tasks);
+  }
+
+  double current_chi2 = parallelChi2(ranges);
+  double lambda = 1e-5;
+  std::vector<Pose> backup;
+  VectorBlockVector delta;
+  int iteration = 0;
+  while(iteration < max_iterations && current_chi2 > 0){
+    QtConcurrent::blockingMap(ranges, boost::bind(&PoseGraphLM::linearizeRange, this, _1));
+    buildSystem();
+    iteration++;
+
+    bool improved = false;
+    double new_chi2 = current_chi2;
+    backup = poses_;
+    for(int attempt = 0; attempt < 10 && !improved; attempt++){
+      if(factorize(lambda)){
+        solve(delta);
+        for(unsigned int v = 0; v < poses_.size(); v++){
+          if(position_[v] >= 0) poses_[v] = boxPlus(backup[v], delta[position_[v]]);
+        }
+        new_chi2 = parallelChi2(ranges);
+        improved = new_chi2 < current_chi2;
+      }
+      if(improved){
+        lambda = std::max(lambda / 10, 1e-12);
+      } else {
+        poses_ = backup;
+        lambda *= 10;
+      }
+    }
+    if(!improved) break; //at a minimum (or a numerical problem)
+    double improvement = (current_chi2 - new_chi2) / current_chi2;
+    current_chi2 = new_chi2;
+    if(improvement < min_improvement) break;
+  }
+  return iteration;
+}
+
+void PoseGraphLM::save(std::ostream& out) const {
+  std::streamsize precision = out.precision(10);
+  for(unsigned int v = 0; v < poses_.size(); v++){
+    const Pose& p = poses_[v];
+    Eigen::Vector3d rpy = rotationToRPY(p.rotation);
+    out << "VERTEX3 " << v << " " << p.translation(0) << " " << p.translation(1) << " " << p.translation(2)
+        << " " << rpy(0) << " " << rpy(1) << " " << rpy(2) << "\n";
+  }
+  for(unsigned int i = 0; i < edges_.size(); i++){
+    const Edge& edge = edges_[i];
+    Eigen::Vector3d rpy = rotationToRPY(edge.mean.rotation);
+    out << "EDGE3 " << edge.from << " " << edge.to << " " << edge.mean.translation(0) << " "
+        << edge.mean.translation(1) << " " << edge.mean.translation(2)
+        << " " << rpy(0) << " " << rpy(1) << " " << rpy(2);
+    for(int r = 0; r < 6; r++){
+      for(int c = r; c < 6; c++) out << " " << edge.information(r, c);
+    }
+    out << "\n";
+  }
+  out.precision(precision);
+}
+
+bool PoseGraphLM::load(std::istream& in){
+  clear();
+  std::map<int, int> ids; //in the file -> here
+  std::string line;
+  while(std::getline(in, line)){
+    std::istringstream fields(line);
+    std::string tag;
+    fields >> tag;
+    if(tag == "VERTEX3"){
+      int id;
+      double x, y, z, roll, pitch, yaw;
+      if(!(fields >> id >> x >> y >> z >> roll >> pitch >> yaw) || ids.count(id)) return false;
+      ids[id] = addVertex(Pose(rpyToRotation(roll, pitch, yaw), Eigen::Vector3d(x, y, z)), poses_.empty());
+    } else if(tag == "EDGE3"){
+      int from, to;
+      double x, y, z, roll, pitch, yaw;
+      Matrix6d information;
+      if(!(fields >> from >> to >> x >> y >> z >> roll >> pitch >> yaw)) return false;
+      for(int r = 0; r < 6; r++){
+        for(int c = r; c < 6; c++){
+          if(!(fields >> information(r, c))) return false;
+          information(c, r) = information(r, c);
+        }
+      }
+      if(!ids.count(from) || !ids.count(to)) return false;
+      addEdge(ids[from], ids[to], Pose(rpyToRotation(roll, pitch, yaw), Eigen::Vector3d(x, y, z)), information);
+    }
+  }
+  return true;
+}
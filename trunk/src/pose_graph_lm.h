@@ -0,0 +1,143 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef POSE_GRAPH_LM_H
+#define POSE_GRAPH_LM_H
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <iostream>
+#include <vector>
+
+//!Levenberg-Marquardt optimization of a 3D pose graph with a block-sparse Cholesky solver
+/** Alternative to the HOG-Man optimizer. Vertices are rigid transformations, an edge
+ * from i to j with mean Z says X_j = X_i * Z. Its error is e = [t; log(R)] of
+ * E = Z^-1 * X_i^-1 * X_j, weighted by the 6x6 information matrix (translation first,
+ * as computed by Node::computeInformationMatrix). Vertices are updated by X * exp(delta).
+ *
+ * The normal equations are stored as 6x6 blocks. The free vertices are ordered by
+ * minimum degree to reduce the fill-in of the factor, whose structure is computed once
+ * per call of optimize(). The Jacobians and Hessian blocks of the edges are computed in
+ * parallel, the factorization itself is sequential.
+ */
+class PoseGraphLM {
+public:
+  typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+  typedef Eigen::Matrix<double, 6, 1> Vector6d;
+
+  ///The rigid transformation x -> rotation * x + translation
+  struct Pose {
+    Eigen::Matrix3d rotation;
+    Eigen::Vector3d translation;
+
+    Pose() : rotation(Eigen::Matrix3d::Identity()), translation(Eigen::Vector3d::Zero()) {}
+    Pose(const Eigen::Matrix3d& r, const Eigen::Vector3d& t) : rotation(r), translation(t) {}
+    Pose operator*(const Pose& other) const {
+      return Pose(rotation * other.rotation, rotation * other.translation + translation);
+    }
+    Pose inverse() const {
+      return Pose(rotation.transpose(), -(rotation.transpose() * translation));
+    }
+  };
+
+  struct Edge {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    int from, to;
+    Pose mean;
+    Matrix6d information;
+  };
+
+  PoseGraphLM();
+
+  ///Returns the id of the new vertex (ids are consecutive, starting at zero).
+  ///Fixed vertices are not optimized, at least one should be fixed
+  int addVertex(const Pose& pose, bool fixed = false);
+  void addEdge(int from, int to, const Pose& mean, const Matrix6d& information);
+  void clear();
+
+  int numVertices() const { return (int)poses_.size(); }
+  int numEdges() const { return (int)edges_.size(); }
+  const Pose& pose(int id) const { return poses_[id]; }
+  const Edge& edge(int index) const { return edges_[index]; }
+  void setPose(int id, const Pose& pose) { poses_[id] = pose; }
+
+  ///Sum of the weighted squared errors of all edges
+  double chi2() const;
+
+  ///Runs at most max_iterations iterations, fewer if chi2 stops decreasing (relatively
+  ///by less than min_improvement). Returns the number of iterations done
+  int optimize(int max_iterations, double min_improvement = 1e-5);
+
+  ///Text format of TORO and HOG-Man, one line per element:
+  ///  VERTEX3 id x y z roll pitch yaw
+  ///  EDGE3 from to x y z roll pitch yaw  I11 I12 I13 I14 I15 I16 I22 I23 ... I66
+  ///The information matrix is given as its upper triangle, ordered like the error
+  ///(translation, rotation). The first vertex is fixed on loading
+  void save(std::ostream& out) const;
+  bool load(std::istream& in);
+
+  ///The error of an edge and its derivatives with respect to the updates of its vertices
+  static void linearizeEdge(const Pose& from, const Pose& to, const Pose& mean,
+                            Vector6d& error, Matrix6d& jacobian_from, Matrix6d& jacobian_to);
+  static Vector6d edgeError(const Pose& from, const Pose& to, const Pose& mean);
+  ///pose * exp(delta), delta = [translation; rotation vector]
+  static Pose boxPlus(const Pose& pose, const Vector6d& delta);
+
+private:
+  typedef std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d> > BlockVector;
+  typedef std::vector<Vector6d, Eigen::aligned_allocator<Vector6d> > VectorBlockVector;
+
+  ///Contribution of one edge to the normal equations
+  struct EdgeTerms {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Matrix6d h_from, h_cross, h_to; ///< J_f^T W J_f, J_f^T W J_t, J_t^T W J_t
+    Vector6d b_from, b_to;          ///< J_f^T W e, J_t^T W e
+  };
+  ///A range of edges processed by one task
+  struct EdgeRange {
+    int begin, end;
+    double chi2;
+  };
+
+  void orderVariables();
+  void symbolicFactorization();
+  void linearizeRange(EdgeRange& range);
+  void chi2Range(EdgeRange& range) const;
+  ///Sums over all ranges, computed in parallel
+  double parallelChi2(std::vector<EdgeRange>& ranges) const;
+  void buildSystem();
+  bool factorize(double lambda);
+  void solve(VectorBlockVector& delta) const;
+
+  std::vector<Pose> poses_;
+  std::vector<bool> fixed_;
+  std::vector<Edge, Eigen::aligned_allocator<Edge> > edges_;
+
+  //Structure, valid during optimize()
+  std::vector<int> position_;       ///< of each vertex in the elimination order, -1 if not optimized
+  std::vector<int> column_start_;   ///< first off-diagonal block of each column of L
+  std::vector<int> block_row_;      ///< row of each off-diagonal block, ascending per column
+  std::vector<int> edge_block_;     ///< off-diagonal block of each edge, -1 if a vertex is fixed
+
+  //Values
+  std::vector<EdgeTerms, Eigen::aligned_allocator<EdgeTerms> > edge_terms_;
+  BlockVector hessian_diagonal_, hessian_blocks_; ///< lower triangle of H, in the structure of L
+  VectorBlockVector gradient_;
+  BlockVector factor_diagonal_, factor_blocks_;   ///< the Cholesky factor L
+};
+
+#endif